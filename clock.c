@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/times.h>
 #include "clock.h"
 
@@ -27,6 +28,8 @@
  * Pentium versions of start_counter() and get_counter()
  *******************************************************/
 
+#include <cpuid.h>
+
 
 /* $begin x86cyclecounter */
 /* Initialize the cycle counter */
@@ -72,6 +75,32 @@ double get_counter()
 }
 /* $end x86cyclecounter */
 
+/*
+ * read_counter_start - Read the cycle counter at the start of a short
+ *     timed region. The lfence keeps earlier instructions from being
+ *     reordered past the rdtsc.
+ */
+unsigned long long read_counter_start()
+{
+    unsigned hi, lo;
+
+    asm volatile("lfence; rdtsc" : "=d" (hi), "=a" (lo) : : "memory");
+    return ((unsigned long long) hi << 32) | lo;
+}
+
+/*
+ * read_counter_end - Read the cycle counter at the end of a short timed
+ *     region. rdtscp waits for the timed code to retire, and the lfence
+ *     keeps later instructions from starting before the read.
+ */
+unsigned long long read_counter_end()
+{
+    unsigned hi, lo, aux;
+
+    asm volatile("rdtscp; lfence" : "=d" (hi), "=a" (lo), "=c" (aux) : : "memory");
+    return ((unsigned long long) hi << 32) | lo;
+}
+
 #elif defined(__alpha)
 
 /****************************************************
@@ -134,6 +163,17 @@ double get_counter()
     return result;
 }
 
+/* The Alpha counter is only 32 bits wide and is not serializing */
+unsigned long long read_counter_start()
+{
+    return counter();
+}
+
+unsigned long long read_counter_end()
+{
+    return counter();
+}
+
 #else
 
 /****************************************************************
@@ -159,6 +199,20 @@ double get_counter()
     printf("Please choose another timing package in config.h.\n");
     exit(1);
 }
+
+unsigned long long read_counter_start()
+{
+    printf("ERROR: You are trying to use a read_counter_start routine in clock.c\n");
+    printf("that has not been implemented yet on this platform.\n");
+    exit(1);
+}
+
+unsigned long long read_counter_end()
+{
+    printf("ERROR: You are trying to use a read_counter_end routine in clock.c\n");
+    printf("that has not been implemented yet on this platform.\n");
+    exit(1);
+}
 #endif
 
 
@@ -180,33 +234,192 @@ double ovhd()
     return result;
 }
 
+/*
+ * op_ovhd - Measure the overhead of a read_counter_start/read_counter_end
+ *     pair. Take the minimum over many tries so that interrupts and
+ *     cache misses don't inflate the result.
+ */
+double op_ovhd()
+{
+    int i;
+    unsigned long long t0, t1, best = ~0ULL;
+
+    for (i = 0; i < 1000; i++) {
+	t0 = read_counter_start();
+	t1 = read_counter_end();
+	if (t1 - t0 < best)
+	    best = t1 - t0;
+    }
+    return (double) best;
+}
+
 /* $begin mhz */
-/* Get the clock rate from /proc */
-double mhz_full(int verbose, int sleeptime __attribute__((unused)))
+
+/*
+ * TSC frequency detection. The cycle counter on current x86 parts ticks
+ * at a fixed rate that has nothing to do with the core clock, so we
+ * ask the kernel or the CPU for that rate and only measure it
+ * ourselves as a last resort.
+ */
+#define CALIB_WINDOWS 5      /* calibration windows, we take the median */
+
+static double tsc_mhz = 0.0; /* cached result of mhz_full */
+
+/* cpuinfo_has_flag - Is flag listed in the flags line of /proc/cpuinfo? */
+static int cpuinfo_has_flag(const char *flag)
 {
-    double mhz = 2281.0;
+    FILE *fp;
+    char line[4096];
+    char *p;
+    size_t len = strlen(flag);
+    int found = 0;
+
+    if ((fp = fopen("/proc/cpuinfo", "r")) == NULL)
+	return 0;
+    while (!found && fgets(line, sizeof(line), fp) != NULL) {
+	if (strncmp(line, "flags", 5) != 0)
+	    continue;
+	for (p = strstr(line, flag); p != NULL; p = strstr(p + 1, flag)) {
+	    if (p[-1] == ' ' && (p[len] == ' ' || p[len] == '\n')) {
+		found = 1;
+		break;
+	    }
+	}
+	break;
+    }
+    fclose(fp);
+    return found;
+}
 
-    if (verbose)
-	printf("Processor clock rate ~= %.1f MHz\n", mhz);
-    return mhz;
+/* tsc_invariant - Does the TSC tick at a constant rate in all P/C-states? */
+static int tsc_invariant(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
 
-#if 0
-    double rate;
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) && eax >= 0x80000007) {
+	__cpuid(0x80000007, eax, ebx, ecx, edx);
+	if (edx & (1 << 8))
+	    return 1;
+    }
+#endif
+    return cpuinfo_has_flag("constant_tsc") && cpuinfo_has_flag("nonstop_tsc");
+}
 
-    start_counter();
-    sleep(sleeptime);
-    rate = get_counter() / (1e6*sleeptime);
-    if (verbose) 
-	printf("Processor clock rate ~= %.1f MHz\n", rate);
-    return rate;
+/* tsc_mhz_sysfs - TSC rate the kernel exports, or 0 if it doesn't */
+static double tsc_mhz_sysfs(void)
+{
+    FILE *fp;
+    double khz = 0.0;
+
+    if ((fp = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r")) == NULL)
+	return 0.0;
+    if (fscanf(fp, "%lf", &khz) != 1)
+	khz = 0.0;
+    fclose(fp);
+    return khz / 1e3;
+}
+
+/*
+ * tsc_mhz_cpuid - TSC rate from CPUID leaf 0x15 (TSC/crystal ratio and
+ *     crystal frequency), else the base frequency from leaf 0x16, else 0.
+ */
+static double tsc_mhz_cpuid(const char **source)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned max, eax, ebx, ecx, edx;
+
+    max = __get_cpuid_max(0, NULL);
+    if (max >= 0x15) {
+	__cpuid_count(0x15, 0, eax, ebx, ecx, edx);
+	if (eax != 0 && ebx != 0 && ecx != 0) {
+	    *source = "CPUID 0x15";
+	    return (double) ecx * ebx / eax / 1e6;
+	}
+    }
+    if (max >= 0x16) {
+	__cpuid_count(0x16, 0, eax, ebx, ecx, edx);
+	if ((eax & 0xffff) != 0) {
+	    *source = "CPUID 0x16";
+	    return (double) (eax & 0xffff);
+	}
+    }
+#else
+    (void) source;
 #endif
+    return 0.0;
+}
+
+/* ns_now - Current CLOCK_MONOTONIC_RAW time in nanoseconds */
+static double ns_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * tsc_mhz_calibrate - Count cycles over CALIB_WINDOWS busy-waits that
+ *     together last about ms milliseconds, and return the median rate.
+ */
+static double tsc_mhz_calibrate(int ms)
+{
+    double rates[CALIB_WINDOWS], tmp;
+    double window = ms * 1e6 / CALIB_WINDOWS;
+    double t0, t1;
+    unsigned long long c0, c1;
+    int i, j;
+
+    for (i = 0; i < CALIB_WINDOWS; i++) {
+	t0 = ns_now();
+	c0 = read_counter_start();
+	do {
+	    t1 = ns_now();
+	} while (t1 - t0 < window);
+	c1 = read_counter_end();
+	rates[i] = (double) (c1 - c0) * 1e3 / (t1 - t0);
+    }
+
+    /* Insertion sort, then take the middle value */
+    for (i = 1; i < CALIB_WINDOWS; i++)
+	for (j = i; j > 0 && rates[j-1] > rates[j]; j--) {
+	    tmp = rates[j-1];
+	    rates[j-1] = rates[j];
+	    rates[j] = tmp;
+	}
+    return rates[CALIB_WINDOWS / 2];
+}
+
+/*
+ * mhz_full - Determine the rate of the cycle counter. Use the kernel's
+ *     value if it exports one, then CPUID, then fall back to measuring
+ *     it against CLOCK_MONOTONIC_RAW for sleeptime milliseconds.
+ */
+double mhz_full(int verbose, int sleeptime)
+{
+    const char *source = "sysfs";
+
+    if (tsc_mhz == 0.0) {
+	if (!tsc_invariant())
+	    fprintf(stderr, "Warning: TSC is not invariant (no constant_tsc); "
+		    "cycle counts may not track elapsed time\n");
+	if ((tsc_mhz = tsc_mhz_sysfs()) == 0.0 &&
+	    (tsc_mhz = tsc_mhz_cpuid(&source)) == 0.0) {
+	    source = "calibrated";
+	    tsc_mhz = tsc_mhz_calibrate(sleeptime);
+	}
+	if (verbose)
+	    printf("Processor clock rate ~= %.1f MHz (%s)\n", tsc_mhz, source);
+    }
+    return tsc_mhz;
 }
 /* $end mhz */
 
-/* Version using a default sleeptime */
+/* Version using a default calibration time of 100 ms */
 double mhz(int verbose)
 {
-    return mhz_full(verbose, 2);
+    return mhz_full(verbose, 100);
 }
 
 /** Special counters that compensate for timer interrupt overhead */
@@ -9,10 +9,18 @@ double get_counter();
 /* Measure overhead for counter */
 double ovhd();
 
-/* Determine clock rate of processor (using a default sleeptime) */
+/* Serialized counter reads that bracket a single short operation */
+unsigned long long read_counter_start();
+unsigned long long read_counter_end();
+
+/* Measure overhead of a read_counter_start/read_counter_end pair */
+double op_ovhd();
+
+/* Determine rate of the cycle counter (using a default sleeptime) */
 double mhz(int verbose);
 
-/* Determine clock rate of processor, having more control over accuracy */
+/* Determine rate of the cycle counter, calibrating for sleeptime ms if
+   neither the kernel nor CPUID reports it */
 double mhz_full(int verbose, int sleeptime);
 
 /** Special counters that compensate for timer interrupt overhead */
@@ -86,20 +86,40 @@
 #define UTIL_WEIGHT .63
 
 /*
- * Alignment requirement in bytes (either 4 or 8)
+ * Alignment requirement in bytes (8, or 16 as the x86-64 ABI expects).
+ * Override with "make ALIGNMENT=16"; mm.c lays out its blocks to match.
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
 /*
  * Maximum heap size in bytes
  */
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
 
+/*
+ * Address space reserved for the heap of the LD_PRELOAD build
+ * (libmm.so). Pages are only backed by memory once they are touched.
+ */
+#define MAX_OS_HEAP (1UL << 31)  /* 2 GB */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
 #define USE_FCYC   1   /* cycle counter w/K-best scheme (x86 & Alpha only) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
 #define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+#define USE_TSC    0   /* serialized rdtscp w/K-best scheme, pinned (x86 only) */
+#define USE_MONORAW 0  /* clock_gettime(CLOCK_MONOTONIC_RAW), pinned (Linux) */
+
+/*
+ * Settings for USE_TSC and USE_MONORAW. The driver pins itself to
+ * PIN_CPU (-1 means whatever cpu it starts on) and, with USE_TSC,
+ * evicts FLUSH_BYTES of cache before each sample (0 means the size of
+ * the last-level cache reported in sysfs).
+ */
+#define PIN_CPU     -1
+#define FLUSH_BYTES 0
 
 #endif /* __CONFIG_H */
@@ -8,6 +8,7 @@
  * the time in CPU cycles for a function f.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <sys/times.h>
 #include <stdio.h>
 
@@ -22,6 +23,7 @@
 #define CLEAR_CACHE 0        /* Clear cache before running test function */
 #define CACHE_BYTES (1<<19)  /* Max cache size in bytes */
 #define CACHE_BLOCK 32       /* Cache block size in bytes */
+#define SERIALIZE 0          /* 1-> use lfence/rdtscp serialized counter reads */
 
 static int kbest = K;
 static int maxsamples = MAXSAMPLES;
@@ -30,6 +32,8 @@ static int compensate = COMPENSATE;
 static int clear_cache = CLEAR_CACHE;
 static int cache_bytes = CACHE_BYTES;
 static int cache_block = CACHE_BLOCK;
+static int serialize = SERIALIZE;
+static test_funct prepare = NULL;
 
 static int *cache_buf = NULL;
 
@@ -130,9 +134,22 @@ double fcyc(test_funct f, void *argp)
 {
     double result;
     init_sampler();
-    if (compensate) {
+    if (serialize) {
+	do {
+	    unsigned long long start;
+	    if (prepare)
+		prepare(argp);
+	    if (clear_cache)
+		clear();
+	    start = read_counter_start();
+	    f(argp);
+	    add_sample((double) (read_counter_end() - start));
+	} while (!has_converged() && samplecount < maxsamples);
+    } else if (compensate) {
 	do {
 	    double cyc;
+	    if (prepare)
+		prepare(argp);
 	    if (clear_cache)
 		clear();
 	    start_comp_counter();
@@ -143,6 +160,8 @@ double fcyc(test_funct f, void *argp)
     } else {
 	do {
 	    double cyc;
+	    if (prepare)
+		prepare(argp);
 	    if (clear_cache)
 		clear();
 	    start_counter();
@@ -167,6 +186,36 @@ double fcyc(test_funct f, void *argp)
     return result;  
 }
 
+/*
+ * fcyc_samples - Run f n times and store the cycles used by every run
+ *     in samples[], instead of keeping only the K best. Uses the same
+ *     cache clearing, compensation and serialization settings as fcyc.
+ */
+void fcyc_samples(test_funct f, void *argp, int n, double *samples)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if (prepare)
+	    prepare(argp);
+	if (clear_cache)
+	    clear();
+	if (serialize) {
+	    unsigned long long start = read_counter_start();
+	    f(argp);
+	    samples[i] = (double) (read_counter_end() - start);
+	} else if (compensate) {
+	    start_comp_counter();
+	    f(argp);
+	    samples[i] = get_comp_counter();
+	} else {
+	    start_counter();
+	    f(argp);
+	    samples[i] = get_counter();
+	}
+    }
+}
+
 
 /*************************************************************
  * Set the various parameters used by the measurement routines 
@@ -182,6 +231,16 @@ void set_fcyc_clear_cache(int clear)
     clear_cache = clear;
 }
 
+/*
+ * set_fcyc_prepare - When set, will run prepare(argp) before each
+ *     measurement, untimed, to put f's input back in place.
+ *     Default = NULL
+ */
+void set_fcyc_prepare(test_funct prepare_arg)
+{
+    prepare = prepare_arg;
+}
+
 /* 
  * set_fcyc_cache_size - Set size of cache to use when clearing cache 
  *     Default = 1<<19 (512KB)
@@ -216,6 +275,17 @@ void set_fcyc_compensate(int compensate_arg)
     compensate = compensate_arg;
 }
 
+/* 
+ * set_fcyc_serialize - When set, will bracket each sample with
+ *     serialized counter reads (lfence;rdtsc ... rdtscp;lfence) and
+ *     ignore the compensate setting
+ *     Default = 0
+ */
+void set_fcyc_serialize(int serialize_arg)
+{
+    serialize = serialize_arg;
+}
+
 /* 
  * set_fcyc_k - Value of K in K-best measurement scheme
  *     Default = 3
@@ -246,6 +316,68 @@ void set_fcyc_epsilon(double epsilon_arg)
 }
 
 
+/*
+ * get_llc_size - Return the size in bytes of the last-level data or
+ *     unified cache that cpu sees, according to sysfs, and store its
+ *     line size in *line. Returns 0 if sysfs has no cache information.
+ */
+int get_llc_size(int cpu, int *line)
+{
+    char path[256], type[32];
+    FILE *fp;
+    int index, level, best_level = 0, bytes = 0, linesize;
+    long size;
+    char unit;
+
+    for (index = 0; ; index++) {
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/type",
+		cpu, index);
+	if ((fp = fopen(path, "r")) == NULL)
+	    break;
+	if (fscanf(fp, "%31s", type) != 1)
+	    type[0] = 0;
+	fclose(fp);
+	if (strcmp(type, "Data") != 0 && strcmp(type, "Unified") != 0)
+	    continue;
 
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+		cpu, index);
+	if ((fp = fopen(path, "r")) == NULL)
+	    continue;
+	if (fscanf(fp, "%d", &level) != 1)
+	    level = 0;
+	fclose(fp);
+	if (level <= best_level)
+	    continue;
 
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/size",
+		cpu, index);
+	if ((fp = fopen(path, "r")) == NULL)
+	    continue;
+	unit = 0;
+	if (fscanf(fp, "%ld%c", &size, &unit) < 1)
+	    size = 0;
+	fclose(fp);
+	if (unit == 'K')
+	    size <<= 10;
+	else if (unit == 'M')
+	    size <<= 20;
+	if (size <= 0 || size > (1L << 30))
+	    continue;
 
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/coherency_line_size",
+		cpu, index);
+	linesize = CACHE_BLOCK;
+	if ((fp = fopen(path, "r")) != NULL) {
+	    if (fscanf(fp, "%d", &linesize) != 1 || linesize <= 0)
+		linesize = CACHE_BLOCK;
+	    fclose(fp);
+	}
+
+	best_level = level;
+	bytes = (int) size;
+	if (line)
+	    *line = linesize;
+    }
+    return bytes;
+}
@@ -13,6 +13,9 @@ typedef void (*test_funct)(void *);
 /* Compute number of cycles used by test function f */
 double fcyc(test_funct f, void* argp);
 
+/* Store the cycles used by each of n runs of f in samples[] */
+void fcyc_samples(test_funct f, void *argp, int n, double *samples);
+
 /*********************************************************
  * Set the various parameters used by measurement routines 
  *********************************************************/
@@ -24,6 +27,13 @@ double fcyc(test_funct f, void* argp);
  */
 void set_fcyc_clear_cache(int clear);
 
+/*
+ * set_fcyc_prepare - When set, will run prepare(argp) before each
+ *     measurement, untimed, to put f's input back in place.
+ *     Default = NULL
+ */
+void set_fcyc_prepare(test_funct prepare);
+
 /* 
  * set_fcyc_cache_size - Set size of cache to use when clearing cache 
  *     Default = 1<<19 (512KB)
@@ -43,6 +53,13 @@ void set_fcyc_cache_block(int bytes);
  */
 void set_fcyc_compensate(int compensate_arg);
 
+/* 
+ * set_fcyc_serialize - When set, will bracket each sample with
+ *     serialized counter reads (lfence;rdtsc ... rdtscp;lfence)
+ *     Default = 0
+ */
+void set_fcyc_serialize(int serialize_arg);
+
 /* 
  * set_fcyc_k - Value of K in K-best measurement scheme
  *     Default = 3
@@ -63,6 +80,8 @@ void set_fcyc_maxsamples(int maxsamples_arg);
  */
 void set_fcyc_epsilon(double epsilon_arg);
 
-
-
-
+/*
+ * get_llc_size - Size in bytes of the last-level cache seen by cpu,
+ *     from sysfs, with its line size stored in *line. 0 if unknown.
+ */
+int get_llc_size(int cpu, int *line);
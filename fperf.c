@@ -0,0 +1,135 @@
+/*
+ * fperf.c - Count hardware events used by a function f
+ *
+ * Each event gets its own perf_event_open descriptor rather than one
+ * event group, so a single unsupported event (many VMs expose cycles
+ * and instructions but no cache events) does not take the others
+ * down with it. The counters only count user-mode events of this
+ * thread.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "fperf.h"
+
+const char *fperf_names[FPERF_NEVENTS] = {
+    "cycles", "instr", "L1D-miss", "LLC-miss", "dTLB-miss", "br-miss"
+};
+
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+static const struct {
+    unsigned type;
+    unsigned long long config;
+} events[FPERF_NEVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+				      PERF_COUNT_HW_CACHE_OP_READ,
+				      PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+				      PERF_COUNT_HW_CACHE_OP_READ,
+				      PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int fds[FPERF_NEVENTS];
+static int initialized = 0;
+
+/* The layout of a read() with the TOTAL_TIME_* read formats */
+struct read_format {
+    unsigned long long value;
+    unsigned long long time_enabled;
+    unsigned long long time_running;
+};
+
+static int open_event(int i)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    /* this thread, any cpu */
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * init_fperf - Open one descriptor per event
+ */
+int init_fperf(int verbose)
+{
+    int i, n = 0, err = 0;
+
+    for (i = 0; i < FPERF_NEVENTS; i++) {
+	fds[i] = open_event(i);
+	if (fds[i] >= 0)
+	    n++;
+	else if (err == 0)
+	    err = errno;
+    }
+    initialized = 1;
+
+    if (verbose) {
+	if (n == 0)
+	    printf("Hardware counters unavailable (%s); "
+		   "check /proc/sys/kernel/perf_event_paranoid.\n",
+		   strerror(err));
+	else if (n < FPERF_NEVENTS)
+	    printf("Counting %d of %d hardware events.\n", n, FPERF_NEVENTS);
+    }
+    return n;
+}
+
+/*
+ * fperf - Count the events used by one run of f(argp)
+ */
+int fperf(fperf_test_funct f, void *argp, double counts[FPERF_NEVENTS])
+{
+    struct read_format rf;
+    int i, n = 0;
+
+    if (!initialized)
+	init_fperf(0);
+
+    for (i = 0; i < FPERF_NEVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+    for (i = 0; i < FPERF_NEVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+
+    f(argp);
+
+    for (i = 0; i < FPERF_NEVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < FPERF_NEVENTS; i++) {
+	counts[i] = -1;
+	if (fds[i] < 0)
+	    continue;
+	if (read(fds[i], &rf, sizeof(rf)) != sizeof(rf) || rf.time_running == 0)
+	    continue;
+	/* Scale up if the kernel multiplexed this counter */
+	counts[i] = (double) rf.value;
+	if (rf.time_running < rf.time_enabled)
+	    counts[i] *= (double) rf.time_enabled / (double) rf.time_running;
+	n++;
+    }
+    return n;
+}
@@ -0,0 +1,39 @@
+/*
+ * fperf.h - hardware performance counters around a test function f
+ *
+ * Uses the Linux perf_event_open interface to count events in user
+ * mode while f runs. Counters the kernel refuses to open (no PMU,
+ * perf_event_paranoid, seccomp, ...) are simply left out.
+ */
+#ifndef __FPERF_H_
+#define __FPERF_H_
+
+/* The events we try to count, in reporting order */
+#define FPERF_CYCLES        0
+#define FPERF_INSTRUCTIONS  1
+#define FPERF_L1D_MISSES    2
+#define FPERF_LLC_MISSES    3
+#define FPERF_DTLB_MISSES   4
+#define FPERF_BRANCH_MISSES 5
+#define FPERF_NEVENTS       6
+
+typedef void (*fperf_test_funct)(void *);
+
+/* Short column names for each event */
+extern const char *fperf_names[FPERF_NEVENTS];
+
+/*
+ * init_fperf - Open the counters. Returns the number of events that
+ *     can be counted, which is 0 if counters are not permitted here.
+ */
+int init_fperf(int verbose);
+
+/*
+ * fperf - Run f(argp) once and store the count of each event in
+ *     counts[], scaled up if the kernel had to multiplex the counters.
+ *     Events that could not be opened are set to -1. Returns the number
+ *     of events counted.
+ */
+int fperf(fperf_test_funct f, void *argp, double counts[FPERF_NEVENTS]);
+
+#endif /* __FPERF_H_ */
@@ -1,7 +1,9 @@
 /****************************
  * High-level timing wrappers
  ****************************/
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <sched.h>
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
@@ -9,9 +11,34 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static fsecs_test_funct prepare = NULL; /* see set_fsecs_prepare */
 
 extern int verbose; /* -v option in mdriver.c */
 
+#if USE_TSC || USE_MONORAW
+/*
+ * pin_cpu - Keep the driver on one cpu so that samples don't pay for
+ *     migrations or mix counters and caches of different cores.
+ *     Returns the cpu we ended up on.
+ */
+static int pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+	cpu = sched_getcpu();
+    if (cpu < 0)
+	cpu = 0;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+	perror("Warning: sched_setaffinity");
+	return sched_getcpu();
+    }
+    return cpu;
+}
+#endif
+
 /*
  * init_fsecs - initialize the timing package
  */
@@ -30,12 +57,42 @@ void init_fsecs(void)
     set_fcyc_epsilon(0.01);
     set_fcyc_k(3);
     Mhz = mhz(verbose > 0);
+#elif USE_TSC
+    {
+	int cpu = pin_cpu(PIN_CPU);
+	int line = 0;
+	int flush = FLUSH_BYTES ? FLUSH_BYTES : get_llc_size(cpu, &line);
+
+	if (flush == 0)
+	    flush = 1 << 19;
+	if (verbose)
+	    printf("Measuring performance with a serialized cycle counter "
+		   "on cpu %d, flushing %d KB.\n", cpu, flush >> 10);
+
+	set_fcyc_maxsamples(20);
+	set_fcyc_clear_cache(1);
+	set_fcyc_cache_size(flush);
+	if (line > 0)
+	    set_fcyc_cache_block(line);
+	set_fcyc_serialize(1);
+	set_fcyc_epsilon(0.01);
+	set_fcyc_k(3);
+	Mhz = mhz(verbose > 0);
+    }
 #elif USE_ITIMER
     if (verbose)
 	printf("Measuring performance with the interval timer.\n");
 #elif USE_GETTOD
     if (verbose)
 	printf("Measuring performance with gettimeofday().\n");
+#elif USE_MONORAW
+    {
+	int cpu = pin_cpu(PIN_CPU);
+
+	if (verbose)
+	    printf("Measuring performance with CLOCK_MONOTONIC_RAW on cpu %d.\n",
+		   cpu);
+    }
 #endif
 }
 
@@ -44,14 +101,66 @@ void init_fsecs(void)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
-#if USE_FCYC
+#if USE_FCYC || USE_TSC
     double cycles = fcyc(f, argp);
     return cycles/(Mhz*1e6);
-#elif USE_ITIMER
+#else
+    /* the timers average runs back to back; time them one by one */
+    if (prepare) {
+	double secs[10], sum = 0;
+	int i;
+
+	fsecs_samples(f, argp, 10, secs);
+	for (i = 0; i < 10; i++)
+	    sum += secs[i];
+	return sum / 10;
+    }
+#if USE_ITIMER
     return ftimer_itimer(f, argp, 10);
 #elif USE_GETTOD
     return ftimer_gettod(f, argp, 10);
+#elif USE_MONORAW
+    return ftimer_monoraw(f, argp, 10);
+#endif
 #endif 
 }
 
+/*
+ * fsecs_samples - Store the running time of each of n runs of f
+ *     (in seconds) in secs[], for callers that want the distribution
+ *     rather than the best case
+ */
+void fsecs_samples(fsecs_test_funct f, void *argp, int n, double *secs)
+{
+    int i;
 
+#if USE_FCYC || USE_TSC
+    fcyc_samples(f, argp, n, secs);
+    for (i = 0; i < n; i++)
+	secs[i] /= Mhz*1e6;
+#else
+    for (i = 0; i < n; i++) {
+	if (prepare)
+	    prepare(argp);
+#if USE_ITIMER
+	secs[i] = ftimer_itimer(f, argp, 1);
+#elif USE_GETTOD
+	secs[i] = ftimer_gettod(f, argp, 1);
+#elif USE_MONORAW
+	secs[i] = ftimer_monoraw(f, argp, 1);
+#endif
+    }
+#endif
+}
+
+/*
+ * set_fsecs_prepare - Run prepare(argp) before each run of f, without
+ *     timing it; NULL turns it off
+ */
+void set_fsecs_prepare(fsecs_test_funct prepare_arg)
+{
+    prepare = prepare_arg;
+#if USE_FCYC || USE_TSC
+    set_fcyc_prepare(prepare_arg);
+#endif
+}
@@ -2,3 +2,5 @@ typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+void fsecs_samples(fsecs_test_funct f, void *argp, int n, double *secs);
+void set_fsecs_prepare(fsecs_test_funct prepare);
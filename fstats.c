@@ -0,0 +1,179 @@
+/*
+ * fstats.c - robust summary statistics and significance tests for
+ *     timing samples
+ *
+ * Timing samples are skewed to the right (interrupts, cache refills),
+ * so we summarize them with the median and the median absolute
+ * deviation rather than the mean and standard deviation, and compare
+ * two sets of samples with a rank test that makes no normality
+ * assumption.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fstats.h"
+
+#define BOOT_SEED 0x2545F4914F6CDD1DULL
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* sorted_copy - Return a malloc'd, sorted copy of x[0..n-1] */
+static double *sorted_copy(const double *x, int n)
+{
+    double *y;
+
+    if ((y = malloc(n * sizeof(double))) == NULL) {
+	fprintf(stderr, "Fatal error. Malloc failed in fstats\n");
+	exit(1);
+    }
+    memcpy(y, x, n * sizeof(double));
+    qsort(y, n, sizeof(double), cmp_double);
+    return y;
+}
+
+/* median_sorted - Median of an already sorted array */
+static double median_sorted(const double *y, int n)
+{
+    return (n % 2) ? y[n/2] : 0.5 * (y[n/2 - 1] + y[n/2]);
+}
+
+double fstats_median(const double *x, int n)
+{
+    double *y, m;
+
+    if (n <= 0)
+	return 0.0;
+    y = sorted_copy(x, n);
+    m = median_sorted(y, n);
+    free(y);
+    return m;
+}
+
+double fstats_mad(const double *x, int n)
+{
+    double *y, m;
+    int i;
+
+    if (n <= 0)
+	return 0.0;
+    y = sorted_copy(x, n);
+    m = median_sorted(y, n);
+    for (i = 0; i < n; i++)
+	y[i] = fabs(y[i] - m);
+    qsort(y, n, sizeof(double), cmp_double);
+    m = median_sorted(y, n);
+    free(y);
+    return m;
+}
+
+/* xorshift64 - Small seeded generator, so the bootstrap is repeatable */
+static unsigned long long xorshift64(unsigned long long *state)
+{
+    unsigned long long x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+void fstats_bootstrap_ci(const double *x, int n, double level, int nboot,
+			 double *lo, double *hi)
+{
+    unsigned long long state = BOOT_SEED;
+    double *resample, *medians;
+    int b, i, k;
+
+    if (n <= 0 || nboot <= 0) {
+	*lo = *hi = 0.0;
+	return;
+    }
+    resample = malloc(n * sizeof(double));
+    medians = malloc(nboot * sizeof(double));
+    if (resample == NULL || medians == NULL) {
+	fprintf(stderr, "Fatal error. Malloc failed in fstats_bootstrap_ci\n");
+	exit(1);
+    }
+
+    for (b = 0; b < nboot; b++) {
+	for (i = 0; i < n; i++)
+	    resample[i] = x[xorshift64(&state) % (unsigned long long) n];
+	qsort(resample, n, sizeof(double), cmp_double);
+	medians[b] = median_sorted(resample, n);
+    }
+    qsort(medians, nboot, sizeof(double), cmp_double);
+
+    k = (int) ((1.0 - level) / 2.0 * nboot);
+    *lo = medians[k];
+    *hi = medians[nboot - 1 - k];
+
+    free(resample);
+    free(medians);
+}
+
+/* A sample tagged with the group it came from, for ranking */
+typedef struct {
+    double val;
+    int group;
+} tagged_t;
+
+static int cmp_tagged(const void *a, const void *b)
+{
+    return cmp_double(&((const tagged_t *) a)->val,
+		      &((const tagged_t *) b)->val);
+}
+
+double fstats_mann_whitney(const double *x, int nx, const double *y, int ny)
+{
+    tagged_t *all;
+    int n = nx + ny, i, j, t;
+    double rank_x = 0.0, tie_sum = 0.0;
+    double u, mu, sigma, z;
+
+    if (nx <= 0 || ny <= 0)
+	return 1.0;
+    if ((all = malloc(n * sizeof(tagged_t))) == NULL) {
+	fprintf(stderr, "Fatal error. Malloc failed in fstats_mann_whitney\n");
+	exit(1);
+    }
+    for (i = 0; i < nx; i++) {
+	all[i].val = x[i];
+	all[i].group = 0;
+    }
+    for (i = 0; i < ny; i++) {
+	all[nx + i].val = y[i];
+	all[nx + i].group = 1;
+    }
+    qsort(all, n, sizeof(tagged_t), cmp_tagged);
+
+    /* Assign average ranks to runs of ties */
+    for (i = 0; i < n; i = j) {
+	int in_x = 0;
+
+	for (j = i; j < n && all[j].val == all[i].val; j++)
+	    in_x += (all[j].group == 0);
+	t = j - i;
+	rank_x += in_x * 0.5 * (i + 1 + j);  /* ranks i+1..j, averaged */
+	tie_sum += (double) t * t * t - t;
+    }
+    free(all);
+
+    u = rank_x - (double) nx * (nx + 1) / 2.0;
+    mu = (double) nx * ny / 2.0;
+    sigma = sqrt((double) nx * ny / 12.0 *
+		 ((n + 1) - tie_sum / ((double) n * (n - 1))));
+    if (sigma == 0.0)
+	return 1.0;
+
+    /* Continuity correction */
+    z = (fabs(u - mu) - 0.5) / sigma;
+    if (z < 0)
+	z = 0;
+    return erfc(z / sqrt(2.0));
+}
@@ -0,0 +1,30 @@
+/*
+ * fstats.h - robust summary statistics and significance tests for
+ *     timing samples
+ */
+#ifndef __FSTATS_H_
+#define __FSTATS_H_
+
+/* Median of x[0..n-1] (x is not modified) */
+double fstats_median(const double *x, int n);
+
+/* Median absolute deviation from the median of x[0..n-1] */
+double fstats_mad(const double *x, int n);
+
+/*
+ * fstats_bootstrap_ci - Percentile bootstrap confidence interval for
+ *     the median of x[0..n-1] at the given level (e.g. 0.95), using
+ *     nboot resamples. The resampling is seeded, so the same samples
+ *     always give the same interval.
+ */
+void fstats_bootstrap_ci(const double *x, int n, double level, int nboot,
+			 double *lo, double *hi);
+
+/*
+ * fstats_mann_whitney - Two-sided p-value of the Mann-Whitney U test
+ *     that x and y come from the same distribution (normal
+ *     approximation with tie correction).
+ */
+double fstats_mann_whitney(const double *x, int nx, const double *y, int ny);
+
+#endif /* __FSTATS_H_ */
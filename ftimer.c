@@ -7,8 +7,10 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_monoraw: version that uses clock_gettime(CLOCK_MONOTONIC_RAW)
  */
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include "ftimer.h"
 
@@ -52,6 +54,25 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     return (1E-3*diff);
 }
 
+/* 
+ * ftimer_monoraw - Use the raw monotonic clock, which is not slewed by
+ * NTP, to estimate the running time of f(argp). Return the average of
+ * n runs.
+ */
+double ftimer_monoraw(ftimer_test_funct f, void *argp, int n)
+{
+    int i;
+    struct timespec sts, ets;
+    double diff;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &sts);
+    for (i = 0; i < n; i++) 
+	f(argp);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ets);
+    diff = (ets.tv_sec - sts.tv_sec) + 1E-9*(ets.tv_nsec - sts.tv_nsec);
+    return diff / n;
+}
+
 
 /*
  * Routines for manipulating the Unix interval timer
@@ -0,0 +1,659 @@
+/*
+ * gentrace.c - Generate synthetic malloc traces for mdriver
+ *
+ * Writes a .rep trace (the format read_trace() in mdriver.c reads)
+ * from a parametric model of a workload:
+ *
+ *   - a request size distribution (-d),
+ *   - an object lifetime distribution, measured in requests (-l),
+ *   - the fraction of objects that grow through a chain of reallocs
+ *     (-r),
+ *   - the fraction of objects allocated with memalign, and their
+ *     alignment (-a),
+ *   - the fraction of allocations that are batches of same-sized
+ *     objects, allocated and freed together (-b),
+ *   - the fraction of objects that belong to a request scope and are
+ *     released together when the scope ends, through an arena (-q) or
+ *     one free at a time (-Q),
+ *   - a cap on the live working set (-w), enforced by freeing the
+ *     objects closest to death first,
+ *   - phases: giving -d and -l more than once splits the trace into
+ *     equal phases, the i-th phase using the i-th -d and -l (the last
+ *     one given is reused when one list is shorter). Objects outlive
+ *     the phase that allocated them.
+ *
+ * Every random choice comes from a private xoshiro256** generator
+ * seeded with -s, so a given command line always produces the same
+ * trace on every machine.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAXPHASES    16
+#define MAXCLASSES   32
+#define MAXSIZE      (1 << 30)   /* largest request we will emit */
+#define RANGES_LIMIT 100000      /* above this many ops, set ignore-ranges */
+
+/******************************************
+ * Seeded random numbers (xoshiro256**)
+ ******************************************/
+
+static unsigned long long rng_state[4];
+
+static unsigned long long rotl(unsigned long long x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static unsigned long long rng_next(void)
+{
+	unsigned long long *s = rng_state;
+	unsigned long long result = rotl(s[1] * 5, 7) * 9;
+	unsigned long long t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+/* rng_seed - expand a 64-bit seed into the generator state (splitmix64) */
+static void rng_seed(unsigned long long seed)
+{
+	int i;
+	unsigned long long z;
+
+	for (i = 0; i < 4; i++) {
+		z = (seed += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		rng_state[i] = z ^ (z >> 31);
+	}
+}
+
+/* rng_unit - uniform double in [0, 1) */
+static double rng_unit(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* rng_range - uniform integer in [lo, hi] */
+static long rng_range(long lo, long hi)
+{
+	return lo + (long) (rng_next() % (unsigned long long) (hi - lo + 1));
+}
+
+/*******************************
+ * Size and lifetime models
+ ******************************/
+
+typedef struct {
+	enum { SZ_UNIFORM, SZ_POWER, SZ_BIMODAL, SZ_CLASSES } kind;
+	long lo, hi;          /* uniform and power bounds; bimodal modes */
+	double alpha;         /* power-law exponent; bimodal P(large) */
+	int nclasses;
+	long class_size[MAXCLASSES];
+	double class_cum[MAXCLASSES]; /* cumulative weights, last is 1 */
+} size_model_t;
+
+typedef struct {
+	enum { LT_FIXED, LT_EXP, LT_POWER } kind;
+	double a, b;          /* fixed: a; exp: mean a; power: min a, alpha b */
+} life_model_t;
+
+static void app_error(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2), noreturn));
+
+static void app_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "gentrace: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+/*
+ * parse_size_model - uniform:<min>:<max>, power:<min>:<max>:<alpha>,
+ *    bimodal:<small>:<large>:<p_large> or classes:<size>/<weight>,...
+ */
+static void parse_size_model(const char *arg, size_model_t *m)
+{
+	const char *p;
+	char *end;
+	double total = 0, w;
+	int i;
+
+	memset(m, 0, sizeof(*m));
+	if (sscanf(arg, "uniform:%ld:%ld", &m->lo, &m->hi) == 2) {
+		m->kind = SZ_UNIFORM;
+	} else if (sscanf(arg, "power:%ld:%ld:%lf", &m->lo, &m->hi, &m->alpha) == 3) {
+		m->kind = SZ_POWER;
+		if (m->alpha <= 0)
+			app_error("power-law alpha must be positive in '%s'", arg);
+	} else if (sscanf(arg, "bimodal:%ld:%ld:%lf", &m->lo, &m->hi, &m->alpha) == 3) {
+		m->kind = SZ_BIMODAL;
+		if (m->alpha < 0 || m->alpha > 1)
+			app_error("bimodal P(large) must be in [0,1] in '%s'", arg);
+	} else if (strncmp(arg, "classes:", 8) == 0) {
+		m->kind = SZ_CLASSES;
+		for (p = arg + 8; *p; p = (*end == ',') ? end + 1 : end) {
+			if (m->nclasses == MAXCLASSES)
+				app_error("at most %d size classes", MAXCLASSES);
+			m->class_size[m->nclasses] = strtol(p, &end, 10);
+			w = 1.0;
+			if (*end == '/')
+				w = strtod(end + 1, &end);
+			if (end == p || (*end != ',' && *end != 0) || w < 0)
+				app_error("bad size class list '%s'", arg);
+			total += w;
+			m->class_cum[m->nclasses++] = total;
+		}
+		if (m->nclasses == 0 || total <= 0)
+			app_error("empty size class list '%s'", arg);
+		for (i = 0; i < m->nclasses; i++)
+			m->class_cum[i] /= total;
+		m->lo = m->hi = 1;
+	} else {
+		app_error("unknown size distribution '%s'", arg);
+	}
+	if (m->kind != SZ_CLASSES &&
+			(m->lo < 1 || m->hi < m->lo || m->hi > MAXSIZE))
+		app_error("sizes must satisfy 1 <= min <= max <= %d in '%s'",
+				MAXSIZE, arg);
+	for (i = 0; i < m->nclasses; i++)
+		if (m->class_size[i] < 1 || m->class_size[i] > MAXSIZE)
+			app_error("class sizes must be in [1, %d] in '%s'", MAXSIZE, arg);
+}
+
+/* draw_size - sample a request size */
+static long draw_size(const size_model_t *m)
+{
+	double u, lo, hi, x;
+	long mode;
+	int i;
+
+	switch (m->kind) {
+		case SZ_UNIFORM:
+			return rng_range(m->lo, m->hi);
+
+		case SZ_POWER: /* truncated Pareto by inverse transform */
+			u = rng_unit();
+			lo = pow((double) m->lo, -m->alpha);
+			hi = pow((double) m->hi + 1, -m->alpha);
+			x = pow(lo - u * (lo - hi), -1.0 / m->alpha);
+			return (x > m->hi) ? m->hi : (long) x;
+
+		case SZ_BIMODAL: /* each mode spread +-25% */
+			mode = (rng_unit() < m->alpha) ? m->hi : m->lo;
+			x = mode * (0.75 + 0.5 * rng_unit());
+			return (x < 1) ? 1 : (x > MAXSIZE) ? MAXSIZE : (long) x;
+
+		case SZ_CLASSES:
+			u = rng_unit();
+			for (i = 0; i < m->nclasses - 1 && u >= m->class_cum[i]; i++)
+				;
+			return m->class_size[i];
+	}
+	return 1;
+}
+
+/* parse_life_model - fixed:<n>, exp:<mean> or power:<min>:<alpha> */
+static void parse_life_model(const char *arg, life_model_t *m)
+{
+	memset(m, 0, sizeof(*m));
+	if (sscanf(arg, "fixed:%lf", &m->a) == 1)
+		m->kind = LT_FIXED;
+	else if (sscanf(arg, "exp:%lf", &m->a) == 1)
+		m->kind = LT_EXP;
+	else if (sscanf(arg, "power:%lf:%lf", &m->a, &m->b) == 2)
+		m->kind = LT_POWER;
+	else
+		app_error("unknown lifetime distribution '%s'", arg);
+	if (m->a < 1 || (m->kind == LT_POWER && m->b <= 0))
+		app_error("bad lifetime parameters in '%s'", arg);
+}
+
+/* draw_life - sample a lifetime in requests, at least 1 */
+static double draw_life(const life_model_t *m)
+{
+	double u = rng_unit();
+
+	switch (m->kind) {
+		case LT_FIXED:
+			return m->a;
+		case LT_EXP:
+			return 1.0 - m->a * log(1.0 - u);
+		case LT_POWER:
+			return m->a * pow(1.0 - u, -1.0 / m->b);
+	}
+	return 1.0;
+}
+
+/************************************************
+ * Pending frees and reallocs, ordered by time
+ ***********************************************/
+
+typedef struct {
+	double time;
+	int id;
+	int grow;      /* 1: realloc the object larger, 0: free it */
+	int count;     /* objects id.. freed together: a batch if > 1 */
+} event_t;
+
+static event_t *heap;
+static int heap_len, heap_cap;
+
+static void heap_push(double time, int id, int grow, int count)
+{
+	int i, parent;
+	event_t e;
+
+	if (heap_len == heap_cap) {
+		heap_cap = heap_cap ? 2 * heap_cap : 1024;
+		if ((heap = realloc(heap, heap_cap * sizeof(event_t))) == NULL)
+			app_error("out of memory");
+	}
+	e.time = time;
+	e.id = id;
+	e.grow = grow;
+	e.count = count;
+	for (i = heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (heap[parent].time <= time)
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i] = e;
+}
+
+static event_t heap_pop(void)
+{
+	event_t top = heap[0], last = heap[--heap_len];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < heap_len) {
+		if (child + 1 < heap_len && heap[child + 1].time < heap[child].time)
+			child++;
+		if (last.time <= heap[child].time)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (heap_len > 0)
+		heap[i] = last;
+	return top;
+}
+
+/**********************
+ * The generated trace
+ *********************/
+
+typedef struct {
+	char type;     /* 'a', 'm', 'r', 'f', 's', 'B', 'F', 'A', 'n', 'R' or 'D' */
+	int id;
+	long size;
+	long align;    /* 'm' only */
+	int count;     /* 'B' and 'F' only */
+	int arena;     /* 'A', 'n', 'R' and 'D' only */
+} op_t;
+
+static op_t *ops;
+static long nops, ops_cap;
+
+static long *obj_size;    /* current size of each id, 0 once freed */
+static int nids, ids_cap;
+
+static void emit(char type, int id, long size)
+{
+	if (nops == ops_cap) {
+		ops_cap = ops_cap ? 2 * ops_cap : 4096;
+		if ((ops = realloc(ops, ops_cap * sizeof(op_t))) == NULL)
+			app_error("out of memory");
+	}
+	ops[nops].type = type;
+	ops[nops].id = id;
+	ops[nops].size = size;
+	ops[nops].align = 0;
+	ops[nops].count = 1;
+	ops[nops].arena = 0;
+	nops++;
+}
+
+static void emit_aligned(int id, long size, long align)
+{
+	emit('m', id, size);
+	ops[nops - 1].align = align;
+}
+
+static void emit_batch(char type, int id, int count, long size)
+{
+	emit(type, id, size);
+	ops[nops - 1].count = count;
+}
+
+static void emit_arena(char type, int arena, int id, long size)
+{
+	emit(type, id, size);
+	ops[nops - 1].arena = arena;
+}
+
+static int new_id(long size)
+{
+	if (nids == ids_cap) {
+		ids_cap = ids_cap ? 2 * ids_cap : 4096;
+		if ((obj_size = realloc(obj_size, ids_cap * sizeof(long))) == NULL)
+			app_error("out of memory");
+	}
+	obj_size[nids] = size;
+	return nids++;
+}
+
+/*
+ * retire - Free the object (or batch) of a death event, with a sized
+ *    free if asked to. Returns the bytes freed, 0 if it was already
+ *    freed early to respect -w.
+ */
+static long retire(const event_t *e, int sized)
+{
+	long bytes = 0;
+	int k;
+
+	if (obj_size[e->id] == 0)
+		return 0;
+	for (k = 0; k < e->count; k++) {
+		bytes += obj_size[e->id + k];
+		obj_size[e->id + k] = 0;
+	}
+	if (e->count > 1)
+		emit_batch('F', e->id, e->count, 0);
+	else
+		emit(sized ? 's' : 'f', e->id, 0);
+	return bytes;
+}
+
+/*********************************************
+ * Request scopes: objects that die together
+ ********************************************/
+
+static int scope_n;         /* objects per scope */
+static int scope_plain;     /* free objects one by one, not via an arena */
+static int *scope_ids;      /* the objects of scope a are at a * scope_n */
+static int *scope_len;
+
+/*
+ * end_scope - Release every object of scope a: reset its arena (or
+ *    destroy it at the end of the trace), or free the objects one at a
+ *    time with -Q. Returns the bytes released.
+ */
+static long end_scope(int a, int last)
+{
+	long bytes = 0;
+	int k, id;
+
+	for (k = 0; k < scope_len[a]; k++) {
+		id = scope_ids[a * scope_n + k];
+		bytes += obj_size[id];
+		obj_size[id] = 0;
+		if (scope_plain)
+			emit('f', id, 0);
+	}
+	if (!scope_plain)
+		emit_arena(last ? 'D' : 'R', a, 0, 0);
+	scope_len[a] = 0;
+	return bytes;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: gentrace [-h] [-s seed] [-n ops] [-d sizes]... [-l lifetimes]...\n"
+		"                [-r prob:growth:steps] [-a prob:align] [-b prob:n]\n"
+		"                [-z] [-q prob:n:k] [-Q] [-w bytes] [-i] [-o file]\n"
+		"Options\n"
+		"\t-s <seed>     Random seed (default 1).\n"
+		"\t-n <ops>      Approximate number of requests (default 10000).\n"
+		"\t-d <sizes>    Size distribution; repeat for more phases:\n"
+		"\t                uniform:<min>:<max>\n"
+		"\t                power:<min>:<max>:<alpha>\n"
+		"\t                bimodal:<small>:<large>:<p_large>\n"
+		"\t                classes:<size>[/<weight>],...\n"
+		"\t-l <lifetime> Lifetime in requests; repeat for more phases:\n"
+		"\t                fixed:<n>  exp:<mean>  power:<min>:<alpha>\n"
+		"\t-r <p:g:k>    With probability p an object is realloc'ed k times\n"
+		"\t              during its life, growing by factor g each time.\n"
+		"\t-a <p:align>  With probability p an object is allocated with\n"
+		"\t              memalign to align bytes (a power of two).\n"
+		"\t-b <p:n>      With probability p an allocation is a batch of n\n"
+		"\t              objects of one size, freed together.\n"
+		"\t-z            Free single objects with sized frees.\n"
+		"\t-q <p:n:k>    With probability p an object belongs to one of k\n"
+		"\t              request scopes, each released after n objects\n"
+		"\t              by resetting its arena.\n"
+		"\t-Q            Release request scopes with one free per object.\n"
+		"\t-w <bytes>    Cap on live bytes; frees the next objects to die early.\n"
+		"\t-i            Set the ignore-ranges flag in the trace header.\n"
+		"\t-o <file>     Write the trace to <file> instead of stdout.\n");
+}
+
+int main(int argc, char **argv)
+{
+	size_model_t sizes[MAXPHASES];
+	life_model_t lives[MAXPHASES];
+	int nsizes = 0, nlives = 0, nphases, phase;
+	unsigned long long seed = 1;
+	long target = 10000, live_bytes = 0, working_set = 0, size, i;
+	double chain_p = 0, chain_growth = 2.0, align_p = 0, now, life;
+	long align = 0;
+	double batch_p = 0, scope_p = 0;
+	int scope_k = 0, a;
+	int batch_n = 0, sized_free = 0, count;
+	int chain_steps = 0, ignore_ranges = 0, id, k, c;
+	char *outname = NULL;
+	FILE *out = stdout;
+	event_t e;
+
+	while ((c = getopt(argc, argv, "s:n:d:l:r:a:b:zq:Qw:io:h")) != -1) {
+		switch (c) {
+			case 's':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'n':
+				target = atol(optarg);
+				break;
+			case 'd':
+				if (nsizes == MAXPHASES)
+					app_error("at most %d phases", MAXPHASES);
+				parse_size_model(optarg, &sizes[nsizes++]);
+				break;
+			case 'l':
+				if (nlives == MAXPHASES)
+					app_error("at most %d phases", MAXPHASES);
+				parse_life_model(optarg, &lives[nlives++]);
+				break;
+			case 'r':
+				if (sscanf(optarg, "%lf:%lf:%d", &chain_p, &chain_growth,
+							&chain_steps) != 3 || chain_p < 0 || chain_p > 1 ||
+						chain_growth <= 0 || chain_steps < 0)
+					app_error("bad realloc chain '%s'", optarg);
+				break;
+			case 'a':
+				if (sscanf(optarg, "%lf:%ld", &align_p, &align) != 2 ||
+						align_p < 0 || align_p > 1 || align <= 0 ||
+						(align & (align - 1)) != 0)
+					app_error("bad alignment '%s'", optarg);
+				break;
+			case 'b':
+				if (sscanf(optarg, "%lf:%d", &batch_p, &batch_n) != 2 ||
+						batch_p < 0 || batch_p > 1 || batch_n < 2)
+					app_error("bad batch '%s'", optarg);
+				break;
+			case 'z':
+				sized_free = 1;
+				break;
+			case 'q':
+				if (sscanf(optarg, "%lf:%d:%d", &scope_p, &scope_n,
+							&scope_k) != 3 || scope_p < 0 || scope_p > 1 ||
+						scope_n < 1 || scope_k < 1)
+					app_error("bad request scopes '%s'", optarg);
+				break;
+			case 'Q':
+				scope_plain = 1;
+				break;
+			case 'w':
+				working_set = atol(optarg);
+				break;
+			case 'i':
+				ignore_ranges = 1;
+				break;
+			case 'o':
+				outname = optarg;
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				usage();
+				exit(1);
+		}
+	}
+	if (target < 1)
+		app_error("need at least one request");
+	if (nsizes == 0)
+		parse_size_model("power:8:4096:1.2", &sizes[nsizes++]);
+	if (nlives == 0)
+		parse_life_model("exp:500", &lives[nlives++]);
+	nphases = (nsizes > nlives) ? nsizes : nlives;
+
+	rng_seed(seed);
+
+	if (scope_p > 0) {
+		if ((scope_ids = malloc((size_t) scope_k * scope_n * sizeof(int))) ==
+				NULL || (scope_len = calloc(scope_k, sizeof(int))) == NULL)
+			app_error("out of memory");
+		if (!scope_plain)
+			for (a = 0; a < scope_k; a++)
+				emit_arena('A', a, 0, 0);
+	}
+
+	/*
+	 * Each step first retires the events that are due, then allocates
+	 * one object. Time advances by one per allocation.
+	 */
+	for (now = 0; nops < target; now++) {
+		phase = (int) ((double) nops * nphases / target);
+		if (phase >= nphases)
+			phase = nphases - 1;
+
+		while (heap_len > 0 && heap[0].time <= now) {
+			e = heap_pop();
+			if (obj_size[e.id] == 0)
+				continue;  /* already freed to respect -w */
+			if (e.grow) {
+				size = (long) (obj_size[e.id] * chain_growth);
+				size = (size < 1) ? 1 : (size > MAXSIZE) ? MAXSIZE : size;
+				live_bytes += size - obj_size[e.id];
+				obj_size[e.id] = size;
+				emit('r', e.id, size);
+			} else {
+				live_bytes -= retire(&e, sized_free);
+			}
+		}
+
+		size = draw_size(&sizes[phase < nsizes ? phase : nsizes - 1]);
+
+		/* Make room under the working-set cap */
+		while (working_set > 0 && live_bytes + size > working_set &&
+				heap_len > 0) {
+			e = heap_pop();
+			live_bytes -= retire(&e, sized_free);
+		}
+
+		if (scope_p > 0 && rng_unit() < scope_p) {
+			/* Scoped objects die with their scope, not on their own */
+			a = (int) rng_range(0, scope_k - 1);
+			id = new_id(size);
+			live_bytes += size;
+			if (scope_plain)
+				emit('a', id, size);
+			else
+				emit_arena('n', a, id, size);
+			scope_ids[a * scope_n + scope_len[a]++] = id;
+			if (scope_len[a] == scope_n)
+				live_bytes -= end_scope(a, 0);
+			continue;
+		}
+
+		if (batch_p > 0 && rng_unit() < batch_p) {
+			count = batch_n;
+			id = nids;
+			for (k = 0; k < count; k++)
+				new_id(size);
+			live_bytes += count * size;
+			emit_batch('B', id, count, size);
+		} else {
+			count = 1;
+			id = new_id(size);
+			live_bytes += size;
+			if (align_p > 0 && rng_unit() < align_p)
+				emit_aligned(id, size, align);
+			else
+				emit('a', id, size);
+		}
+
+		life = draw_life(&lives[phase < nlives ? phase : nlives - 1]);
+		if (count == 1 && chain_steps > 0 && rng_unit() < chain_p)
+			for (k = 1; k <= chain_steps; k++)
+				heap_push(now + life * k / (chain_steps + 1), id, 1, 1);
+		heap_push(now + life, id, 0, count);
+	}
+
+	/* Free whatever is still live, in order of death */
+	while (heap_len > 0) {
+		e = heap_pop();
+		if (!e.grow)
+			retire(&e, sized_free);
+	}
+	for (a = 0; a < scope_k; a++)
+		end_scope(a, 1);
+
+	if (outname && (out = fopen(outname, "w")) == NULL)
+		app_error("could not open %s: %s", outname, strerror(errno));
+	if (nops > RANGES_LIMIT)
+		ignore_ranges = 1;
+	fprintf(out, "1\n%d\n%ld\n%d\n", nids, nops, ignore_ranges);
+	for (i = 0; i < nops; i++) {
+		if (ops[i].type == 'f' || ops[i].type == 's')
+			fprintf(out, "%c %d\n", ops[i].type, ops[i].id);
+		else if (ops[i].type == 'B')
+			fprintf(out, "B %d %d %ld\n", ops[i].id, ops[i].count,
+					ops[i].size);
+		else if (ops[i].type == 'F')
+			fprintf(out, "F %d %d\n", ops[i].id, ops[i].count);
+		else if (ops[i].type == 'A' || ops[i].type == 'R' ||
+				ops[i].type == 'D')
+			fprintf(out, "%c %d\n", ops[i].type, ops[i].arena);
+		else if (ops[i].type == 'n')
+			fprintf(out, "n %d %d %ld\n", ops[i].arena, ops[i].id,
+					ops[i].size);
+		else if (ops[i].type == 'm')
+			fprintf(out, "m %d %ld %ld\n", ops[i].id, ops[i].size,
+					ops[i].align);
+		else
+			fprintf(out, "%c %d %ld\n", ops[i].type, ops[i].id, ops[i].size);
+	}
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
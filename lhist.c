@@ -0,0 +1,84 @@
+/*
+ * lhist.c - log-linear latency histograms
+ *
+ * A value v with highest set bit m is stored with shift
+ * s = max(0, m - LHIST_SUB_BITS) in bucket s*LHIST_SUB_BUCKETS + (v >> s).
+ * Values below 2*LHIST_SUB_BUCKETS are exact; larger ones keep their
+ * top LHIST_SUB_BITS+1 bits.
+ */
+#include <string.h>
+
+#include "lhist.h"
+
+/* bucket_of - map a value to its bucket index */
+static int bucket_of(unsigned long long val)
+{
+    int m, s;
+
+    if (val < 2 * LHIST_SUB_BUCKETS)
+	return (int) val;
+    m = 63 - __builtin_clzll(val);
+    s = m - LHIST_SUB_BITS;
+    return s * LHIST_SUB_BUCKETS + (int) (val >> s);
+}
+
+/* bucket_top - largest value that maps to bucket idx */
+static unsigned long long bucket_top(int idx)
+{
+    int s;
+    unsigned long long sub;
+
+    if (idx < 2 * LHIST_SUB_BUCKETS)
+	return (unsigned long long) idx;
+    s = idx / LHIST_SUB_BUCKETS - 1;
+    sub = (unsigned long long) (idx - s * LHIST_SUB_BUCKETS);
+    return ((sub + 1) << s) - 1;
+}
+
+void lhist_reset(lhist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void lhist_record(lhist_t *h, unsigned long long val)
+{
+    h->counts[bucket_of(val)]++;
+    h->total++;
+    if (val > h->max)
+	h->max = val;
+}
+
+void lhist_merge(lhist_t *dst, const lhist_t *src)
+{
+    int i;
+
+    for (i = 0; i < LHIST_BUCKETS; i++)
+	dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+	dst->max = src->max;
+}
+
+unsigned long long lhist_percentile(const lhist_t *h, double p)
+{
+    unsigned long long target, seen = 0;
+    unsigned long long top;
+    int i;
+
+    if (h->total == 0)
+	return 0;
+    target = (unsigned long long) (p * (double) h->total + 0.999999);
+    if (target < 1)
+	target = 1;
+    if (target > h->total)
+	target = h->total;
+
+    for (i = 0; i < LHIST_BUCKETS; i++) {
+	seen += h->counts[i];
+	if (seen >= target) {
+	    top = bucket_top(i);
+	    return (top > h->max) ? h->max : top;
+	}
+    }
+    return h->max;
+}
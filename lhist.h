@@ -0,0 +1,38 @@
+/*
+ * lhist.h - log-linear latency histograms (HDR histogram style)
+ *
+ * Values are bucketed by their highest set bit and then split into
+ * LHIST_SUB_BUCKETS linear sub-buckets, so every recorded value is
+ * known to within 1/LHIST_SUB_BUCKETS of its true value while the whole
+ * 64-bit range fits in a fixed-size table.
+ */
+#ifndef __LHIST_H_
+#define __LHIST_H_
+
+#define LHIST_SUB_BITS    5
+#define LHIST_SUB_BUCKETS (1 << LHIST_SUB_BITS)
+#define LHIST_BUCKETS     ((64 - LHIST_SUB_BITS + 1) * LHIST_SUB_BUCKETS)
+
+typedef struct {
+    unsigned long long counts[LHIST_BUCKETS];
+    unsigned long long total;  /* number of recorded values */
+    unsigned long long max;    /* largest recorded value (exact) */
+} lhist_t;
+
+/* Empty a histogram */
+void lhist_reset(lhist_t *h);
+
+/* Record one value */
+void lhist_record(lhist_t *h, unsigned long long val);
+
+/* Add all of the values in src to dst */
+void lhist_merge(lhist_t *dst, const lhist_t *src);
+
+/*
+ * Return the smallest value v such that at least a fraction p
+ * (0 <= p <= 1) of the recorded values are <= v, rounded up to the
+ * top of its bucket. Returns 0 for an empty histogram.
+ */
+unsigned long long lhist_percentile(const lhist_t *h, double p);
+
+#endif /* __LHIST_H_ */
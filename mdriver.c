@@ -7,17 +7,26 @@
  * Copyright (c) 2004, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <malloc.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
 
 
 #include "mm.h"
@@ -25,22 +34,64 @@
 #include "fsecs.h"
 #include "config.h"
 #include "driverlib.h"
+#include "clock.h"
+#include "lhist.h"
+#include "fperf.h"
+#include "fstats.h"
 
 /**********************
  * Constants and macros
  **********************/
 
 /* OJ */
+#ifndef NO_OJ
 #define OJ
+#endif
 
 /* Misc */
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define ARENA_CLOSED  -2 /* read_ops: arena not open */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Rounds size up to a multiple of ALIGNMENT */
+#define ALIGN_UP(size) (((size) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
+
+/* Backends (-b): allocators outside mm.c, see open_backend */
+#define MAX_BACKENDS   8
+#define FOOTPRINT_EVERY 64 /* requests between samples of their footprint */
+
+/* glibc's mallinfo2 gives the footprint of the libc backend */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#define HAVE_MALLINFO2 1
+#endif
+
+/* Reference allocators, timed on every trace as baselines (see refs[]) */
+#define NUM_REFS       2 /* null and bump */
+#define BUMP_HDR       ALIGN_UP(sizeof(size_t)) /* bump_malloc's size word */
+
+/* Taking the driver's overhead off a time leaves at least this share */
+#define OVHD_FLOOR     0.05
+
+/* Latency histograms are kept per request type and per size class */
+#define LAT_OPS       11 /* one per request type, see traceop_t */
+#define LAT_CLASSES    5 /* see lat_size_class() */
+
+/* Benchmark mode (-B, -S, -C) */
+#define BENCH_DEFAULT   30    /* samples per trace if -S/-C come without -B */
+#define BENCH_BOOT      2000  /* bootstrap resamples for the median's CI */
+#define BENCH_LEVEL     0.95  /* confidence level of that interval */
+#define BENCH_ALPHA     0.01  /* significance level of the comparison */
+#define BENCH_MIN_DIFF  0.01  /* throughput changes below 1% don't count */
+#define BENCH_UTIL_TOL  0.001 /* utilization changes below 0.1% don't count */
+#define EXIT_REGRESSION 2     /* exit status when -C finds a regression */
+
+/* Heap timeline (-T) */
+#define TIMELINE_EVERY  100   /* ops between samples if -N is not given */
+
 /******************************
  * The key compound data types
  *****************************/
@@ -57,16 +108,58 @@ typedef struct range_t {
 	char *lo;              /* low payload address */
 	char *hi;              /* high payload address */
 	struct range_t *next;  /* next list element */
+	struct range_t *prev;  /* previous one, or NULL */
 	int index;             /* same index as free; for debugging */
 } range_t;
 
+/*
+ * One bit for every ALIGNMENT bytes of the heap, set while they belong
+ * to a payload in the range list. Payloads start aligned, so a payload
+ * overlaps another exactly when one of its bits is already set.
+ */
+#define PAYLOAD_BITS (8 * sizeof(unsigned long))
+#define PAYLOAD_WORDS (MAX_HEAP / ALIGNMENT / PAYLOAD_BITS + 1)
+static unsigned long payload_map[PAYLOAD_WORDS];
+static size_t payload_map_words; /* words of it that may be nonzero */
+enum { SPAN_TEST, SPAN_SET, SPAN_CLEAR };
+
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-	enum { ALLOC, FREE, REALLOC } type; /* type of request */
+	enum { ALLOC, FREE, REALLOC, MEMALIGN,
+		SIZED_FREE, MALLOC_BATCH, FREE_BATCH,
+		ARENA_CREATE, ARENA_ALLOC, ARENA_RESET, ARENA_DESTROY } type;
 	int index;                        /* index for free() to use later */
 	size_t size;                      /* byte size of alloc/realloc request */
+	size_t align;                     /* alignment of a memalign request */
+	int count;                        /* ids index.. in a batch request */
+	int arena;                        /* arena of an arena request */
 } traceop_t;
 
+/*
+ * The timed replay reads each request as one 8-byte word: a 3-bit
+ * type, a 29-bit block id and a 32-bit size. The frequent requests
+ * have a type of their own. Everything else, and any request whose id
+ * or size doesn't fit, is OP_OTHER and read from trace->ops. An arena
+ * allocation splits the size field: its arena on top, a 20-bit size.
+ */
+enum { OP_ALLOC, OP_FREE, OP_REALLOC, OP_SIZED_FREE, OP_ARENA_ALLOC,
+	OP_OTHER };
+#define OP_TYPE(op)   ((int)((op) & 7))
+#define OP_INDEX(op)  ((int)(((op) >> 3) & OP_MAX_INDEX))
+#define OP_SIZE(op)   ((size_t)((op) >> 32))
+#define OP_MAX_INDEX  ((1 << 29) - 1)
+#define OP_MAX_SIZE   0xffffffffUL
+#define OP_ARENA(op)  ((int)((op) >> (64 - OP_ARENA_BITS)))
+#define OP_ARENA_SIZE(op) ((size_t)((op) >> 32) & OP_MAX_ARENA_SIZE)
+#define OP_ARENA_BITS 12
+#define OP_MAX_ARENA  ((1 << OP_ARENA_BITS) - 1)
+#define OP_MAX_ARENA_SIZE ((1UL << (32 - OP_ARENA_BITS)) - 1)
+#define PACK_OP(type, index, size) \
+	((uint64_t)(size) << 32 | (uint64_t)(index) << 3 | (uint64_t)(type))
+
+/* The replay prefetches blocks[] for the request this many ahead */
+#define PREFETCH_DIST 8
+
 /* Holds the information for one trace file*/
 typedef struct {
 	char filename[MAXLINE];
@@ -75,9 +168,14 @@ typedef struct {
 	int num_ops;         /* number of distinct requests */
 	int weight;          /* weight for this trace (unused) */
 	traceop_t *ops;      /* array of requests */
+	uint64_t *packed;    /* the same, packed for the timed replay */
 	char **blocks;       /* array of ptrs returned by malloc/realloc... */
 	size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+	range_t **block_ranges; /* ... and their records in the range list */
 	int *block_rand_base;/* index into random_data, if debug is on */
+	int num_arenas;      /* arena ids are 0..num_arenas-1 */
+	mm_arena_t **arenas; /* arenas made by mm_arena_create */
+	int *arena_next;     /* objects of an arena scope, chained by id */
 } trace_t;
 
 /*
@@ -88,6 +186,10 @@ typedef struct {
 typedef struct {
 	trace_t *trace;
 	range_t *ranges;
+	int first, last;          /* replay requests first..last-1 */
+	char **warm_blocks;       /* trace->blocks when the heap was saved (-w) */
+	mm_arena_t **warm_arenas; /* trace->arenas then */
+	int restored;             /* restore_mm ran since the last replay */
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -100,13 +202,59 @@ typedef struct {
 	/* run-time stats defined for both libc and student */
 	int valid;       /* was the trace processed correctly by the allocator? */
 	double secs;     /* number of secs needed to run the trace */
+	double ovhd;     /* secs of that the driver's own loop took */
+	int noisy;       /* ovhd took so much that secs is just the floor */
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
 
+	/* hardware event counts for one timed run, only collected with -P */
+	double perf[FPERF_NEVENTS]; /* -1 if the event could not be counted */
+
+	/* the reference allocators, for mm only (see eval_refs) */
+	double ref_ops;  /* requests they replay: the same as mm, also with -w */
+	double ref_secs[NUM_REFS]; /* secs each took, bump less null's */
+	int ref_noisy[NUM_REFS];   /* bump's secs is just the floor */
+	double oracle;   /* utilization of a perfect packer */
+
+	/* every timing sample in seconds, only kept with -B */
+	int nsamples;
+	double *samples;   /* secs is then the median of these */
+
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/* An mm.c allocation policy (-p) and the replay loop specialized for it */
+typedef struct {
+	const char *name;
+	void (*speed)(void *ptr);  /* eval_mm_speed with the policy compiled in */
+} policy_t;
+
+/* A reference allocator and the replay loop specialized for it */
+typedef struct {
+	const char *name;
+	void (*speed)(void *ptr);
+} ref_t;
+
+/*
+ * An allocator outside mm.c, run with -b. It has no mem_sbrk heap, so
+ * its utilization is measured from its footprint: what mallinfo2 says
+ * for libc, the resident set of the process for the others.
+ */
+typedef struct {
+	char name[MAXLINE];
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*realloc)(void *ptr, size_t size);
+	int (*posix_memalign)(void **ptr, size_t align, size_t size);
+	int libc;  /* the driver's own malloc */
+} backend_t;
+
+/* Per-operation latency histograms for some malloc package (-L) */
+typedef struct {
+	lhist_t hist[LAT_OPS][LAT_CLASSES]; /* indexed by op type, size class */
+} latency_t;
+
 
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
@@ -135,6 +283,33 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* per-operation latency histograms, only collected with -L */
+static int run_latency = 0;
+static latency_t *mm_latency = NULL;
+static latency_t *libc_latency = NULL;
+static double lat_ovhd = 0;  /* cost of one read_counter_start/end pair */
+
+/* hardware performance counters, only collected with -P */
+static int run_perf = 0;
+
+/* benchmark mode: keep all samples, optionally save or compare them */
+static int bench_samples = 0;
+static char *bench_save = NULL;  /* -S: write samples to this file */
+static char *bench_base = NULL;  /* -C: compare against this file */
+
+/* requests replayed once before the heap is saved for timing (-w) */
+static int warmup = 0;
+
+/* quick mode (-q): utilization from the validity run */
+static int quick = 0;
+
+/* machine-readable results, only with -o */
+static char *results_file = NULL;
+
+/* heap statistics sampled during the utilization run, only with -T */
+static FILE *timeline = NULL;
+static int timeline_every = TIMELINE_EVERY; /* -N */
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -152,10 +327,11 @@ char autoresult[SUBMITR_MAXBUF]; /* autoresult string */
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size,
-		const trace_t *trace, int opnum, int index);
-static void remove_range(range_t **ranges, char *lo);
+static int add_range(range_t **ranges, char *lo, int size, size_t align,
+		trace_t *trace, int opnum, int index);
+static void remove_range(range_t **ranges, trace_t *trace, int index);
 static void clear_ranges(range_t **ranges);
+static int payload_span(char *lo, char *hi, int op);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
@@ -166,21 +342,77 @@ static void randomize_block(trace_t *trace, int index);
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		const char *filename);
 static trace_t *read_trace_stdin(stats_t *stats);
+static void read_ops(FILE *tracefile, trace_t *trace);
+static void pack_ops(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
+static void *libc_memalign(size_t align, size_t size);
 static int eval_libc_valid(trace_t *trace);
 static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, range_t **ranges, double *util);
 static double eval_mm_util(trace_t *trace, int tracenum);
+static void timeline_header(FILE *out);
+static void sample_heap(FILE *out, trace_t *trace, int opnum,
+		int requested);
 static void eval_mm_speed(void *ptr);
+static void warm_mm(speed_t *sp);
+static void restore_mm(void *ptr);
+static void unwarm_mm(speed_t *sp);
+static void replay_failed(trace_t *trace, int i);
+static void replay_other(trace_t *trace, int i);
+static void eval_null_speed(void *ptr);
+static double less_ovhd(double secs, double ovhd, int *noisy);
+static void eval_bump_speed(void *ptr);
+static void restore_bump(void *ptr);
+static void eval_refs(trace_t *trace, stats_t *stats);
+#define POLICY_SPEED_DECL(name) static void eval_mm_speed_##name(void *ptr);
+MM_POLICIES(POLICY_SPEED_DECL)
+
+/* Routines for allocators outside mm.c (-b) */
+#ifndef OJ
+static int open_backend(const char *spec, backend_t *be);
+#endif
+static size_t backend_footprint(const backend_t *be, int baseline);
+static int eval_backend_valid(trace_t *trace, const backend_t *be,
+		double *util);
+static void eval_backend_speed(void *ptr);
+static void eval_backend(const backend_t *be, trace_t *trace,
+		stats_t *stats);
+
+/* Routines for measuring per-operation latency of either package */
+static int lat_size_class(size_t size);
+static void lat_record(latency_t *lat, int type, size_t size,
+		unsigned long long t0, unsigned long long t1);
+static void eval_mm_latency(trace_t *trace, latency_t *lat);
+static void eval_libc_latency(trace_t *trace, latency_t *lat);
+static void printlatency(const char *name, latency_t *lat);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printmatrix(const char *title, int m, const char **names,
+		int n, stats_t **stats);
+static void printrefs(int n, stats_t *stats);
+static void printperf(int n, stats_t *stats);
+
+/* Routines for the statistical benchmark mode */
+static void printbench(int n, stats_t *stats);
+static void save_samples(const char *filename, int n, stats_t *stats);
+static int compare_samples(const char *filename, int n, stats_t *stats);
+
+/* Routines for the machine-readable results (-o) */
+static void json_string(FILE *fp, const char *s);
+static void cpu_model(char *buf, size_t len);
+static int build_id_note(struct dl_phdr_info *info, size_t size,
+		void *data);
+static void build_id(char *buf, size_t len);
+static void json_latency(FILE *fp, latency_t *lat);
+static void save_results(const char *filename, int n, stats_t *stats,
+		double util, double thru, double p1, double p2);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	__attribute__((format(printf, 3,4)));
@@ -189,6 +421,30 @@ static void unix_error(const char *fmt, ...)
 static void app_error(const char *fmt, ...)
 	__attribute__((format(printf, 1,2), noreturn));
 
+/* allocation policies of mm.c, selected with -p */
+static const policy_t policies[] = {
+#define POLICY_ENTRY(name) { #name, eval_mm_speed_##name },
+	MM_POLICIES(POLICY_ENTRY)
+};
+#define NUM_POLICIES ((int)(sizeof(policies) / sizeof(policies[0])))
+static void (*mm_speed)(void *ptr) = eval_mm_speed;  /* timed replay loop */
+
+/* reference allocators, null first: eval_refs takes its time off bump's */
+static const ref_t refs[NUM_REFS] = {
+	{ "null", eval_null_speed },
+	{ "bump", eval_bump_speed },
+};
+static int run_refs = 1;  /* not with -p all */
+
+/* allocators outside mm.c, added with -b */
+static backend_t backends[MAX_BACKENDS];
+static int num_backends = 0;
+static const backend_t *backend;  /* the one eval_backend_speed times */
+static int replay_failures = 0;   /* requests it failed, see replay_failed */
+static const backend_t libc_backend = {  /* the driver's own, -l or -b libc */
+	"libc", malloc, free, realloc, posix_memalign, 1
+};
+
 	static sigjmp_buf timeout_jmpbuf;
 	static void timeout_handler(int sig __attribute__((unused))) {
 		fprintf(stderr, "The driver timed out after %d secs\n", set_timeout);
@@ -203,6 +459,7 @@ static void run_tests(int num_tracefiles, char trace_from_stdin,
 		stats_t *mm_stats, range_t *ranges, speed_t *speed_params) {
 	volatile int i;
 	volatile int timed_out = 0;
+	int j;
 
 	for (i=0; i < num_tracefiles; i++) {
 		/* handle timeouts */
@@ -222,7 +479,8 @@ static void run_tests(int num_tracefiles, char trace_from_stdin,
 		} else {
 			if (verbose > 1)
 				printf("Checking mm_malloc for correctness, ");
-			mm_stats[i].valid = eval_mm_valid(trace, &ranges);
+			mm_stats[i].valid = eval_mm_valid(trace, &ranges,
+					quick ? &mm_stats[i].util : NULL);
 
 			if (onetime_flag) {
 				free_trace(trace);
@@ -232,12 +490,49 @@ static void run_tests(int num_tracefiles, char trace_from_stdin,
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i);
+			if (!quick)
+				mm_stats[i].util = eval_mm_util(trace, i);
+			if (run_refs)
+				eval_refs(trace, &mm_stats[i]);
 			speed_params->trace = trace;
 			speed_params->ranges = ranges;
+			speed_params->first = 0;
+			speed_params->last = trace->num_ops;
+			if (warmup > 0 && warmup < trace->num_ops) {
+				warm_mm(speed_params);
+				mm_stats[i].ops = trace->num_ops - speed_params->first;
+			}
 			if (verbose > 1)
 				printf("and performance.\n");
-			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+
+			/*
+			 * The replay loop's own time doesn't count against mm. The
+			 * null reference already took it over the same requests.
+			 */
+			mm_stats[i].ovhd = run_refs ? mm_stats[i].ref_secs[0] :
+				fsecs(eval_null_speed, speed_params);
+			if (bench_samples > 0) {
+				mm_stats[i].nsamples = bench_samples;
+				if ((mm_stats[i].samples =
+							malloc(bench_samples * sizeof(double))) == NULL)
+					unix_error("samples malloc in run_tests failed");
+				fsecs_samples(mm_speed, speed_params, bench_samples,
+						mm_stats[i].samples);
+				for (j = 0; j < bench_samples; j++)
+					mm_stats[i].samples[j] = less_ovhd(mm_stats[i].samples[j],
+							mm_stats[i].ovhd, &mm_stats[i].noisy);
+				mm_stats[i].secs = fstats_median(mm_stats[i].samples,
+						bench_samples);
+			} else {
+				mm_stats[i].secs = less_ovhd(fsecs(mm_speed, speed_params),
+						mm_stats[i].ovhd, &mm_stats[i].noisy);
+			}
+			if (run_latency)
+				eval_mm_latency(trace, mm_latency);
+			if (run_perf)
+				fperf(mm_speed, speed_params, mm_stats[i].perf);
+			if (speed_params->first > 0)
+				unwarm_mm(speed_params);
 		}
 		free_trace(trace);
 	}
@@ -263,9 +558,16 @@ int main(int argc, char **argv)
 	int autograder = 0;   /* if set then called by autograder (-A) */
 
 	/* temporaries used to compute the performance index */
-	double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
+	double secs, ops, util, avg_mm_util, avg_mm_throughput = 0;
+	double p1 = 0, p2 = 0, perfindex;
 	double weight = 0;
 	int numcorrect;
+	int regressions = 0;
+	char *policy = NULL;   /* -p */
+	int sweep = 0;         /* -p all: run every policy, print a matrix */
+	stats_t **sweep_stats; /* per policy, with -p all */
+	stats_t **backend_stats; /* mm, then each backend, with -b */
+	const char *names[NUM_POLICIES + MAX_BACKENDS + 1]; /* matrix columns */
 
 
 	setbuf(stdout, 0);
@@ -278,20 +580,21 @@ int main(int argc, char **argv)
 		num_tracefiles = 1;
 		trace_from_stdin = 1;
 #else
-	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDj")) != EOF) {
+	while ((c = getopt(argc, argv, "d:f:c:s:t:v:p:b:o:hVAlDjLPB:S:C:T:N:w:q")) != EOF) {
 		switch (c) {
 
 			case 'A': /* Hidden Autolab driver argument */
 				autograder = 1;
 				break;
 
-			case 'f': /* Use one specific trace file only (relative to curr dir) */
-				num_tracefiles = 1;
-				if ((tracefiles = realloc(tracefiles, 2 * sizeof(char *))) == NULL)
+			case 'f': /* Use specific trace files only (relative to curr dir) */
+				num_tracefiles++;
+				if ((tracefiles = realloc(tracefiles,
+								(num_tracefiles + 1) * sizeof(char *))) == NULL)
 					unix_error("ERROR: realloc failed in main");
 				strcpy(tracedir, "./");
-				tracefiles[0] = strdup(optarg);
-				tracefiles[1] = NULL;
+				tracefiles[num_tracefiles - 1] = strdup(optarg);
+				tracefiles[num_tracefiles] = NULL;
 				break;
 
 			case 'c': /* Use one specific trace file and run only once */
@@ -305,7 +608,7 @@ int main(int argc, char **argv)
 				break;
 
 			case 't': /* Directory where the traces are located */
-				if (num_tracefiles == 1) /* ignore if -f already encountered */
+				if (num_tracefiles >= 1) /* ignore if -f already encountered */
 					break;
 				strcpy(tracedir, optarg);
 				if (tracedir[strlen(tracedir)-1] != '/')
@@ -316,6 +619,60 @@ int main(int argc, char **argv)
 				run_libc = 1;
 				break;
 
+			case 'L': /* Collect per-operation latency histograms */
+				run_latency = 1;
+				break;
+
+			case 'P': /* Collect hardware performance counters */
+				run_perf = 1;
+				break;
+
+			case 'B': /* Keep this many timing samples per trace */
+				bench_samples = atoi(optarg);
+				break;
+
+			case 'S': /* Save the timing samples for a later -C */
+				bench_save = strdup(optarg);
+				break;
+
+			case 'C': /* Compare against samples saved with -S */
+				bench_base = strdup(optarg);
+				break;
+
+			case 'w': /* Time each trace from the heap after n requests */
+				if ((warmup = atoi(optarg)) < 0)
+					app_error("-w needs a number of requests\n");
+				break;
+
+			case 'q': /* One replay for validity and utilization */
+				quick = 1;
+				break;
+
+			case 'o': /* Write the results as JSON, for scripts */
+				results_file = strdup(optarg);
+				break;
+
+			case 'T': /* Write a CSV timeline of heap statistics */
+				if ((timeline = fopen(optarg, "w")) == NULL)
+					unix_error("Could not open timeline file");
+				break;
+
+			case 'N': /* Take a timeline sample every this many ops */
+				if ((timeline_every = atoi(optarg)) <= 0)
+					app_error("-N needs a positive number of ops\n");
+				break;
+
+			case 'p': /* Allocation policy, or "all" to compare them */
+				policy = strdup(optarg);
+				break;
+
+			case 'b': /* Also run the allocator in this shared object */
+				if (num_backends == MAX_BACKENDS)
+					app_error("At most %d backends\n", MAX_BACKENDS);
+				if (open_backend(optarg, &backends[num_backends]) == 0)
+					num_backends++;
+				break;
+
 			case 'V': /* Increase verbosity level */
 				verbose += 1;
 				break;
@@ -365,9 +722,44 @@ int main(int argc, char **argv)
 		init_random_data();
 	}
 
+	if (timeline != NULL)
+		timeline_header(timeline);
+
+	if (num_backends > 0 && trace_from_stdin)
+		app_error("-b needs trace files, not stdin\n");
+
+	if ((bench_save || bench_base) && bench_samples <= 0)
+		bench_samples = BENCH_DEFAULT;
+
+	/* Time mm.c through the replay loop specialized for its policy */
+	if (policy != NULL && strcmp(policy, "all") == 0) {
+		sweep = 1;
+		run_refs = 0;
+
+		/* The sweep prints its matrix and nothing else */
+		if (bench_save || bench_base || num_backends > 0 || results_file)
+			app_error("-p all can't be combined with -S, -C, -b or -o\n");
+	} else if (policy != NULL && mm_set_policy(policy) < 0)
+		app_error("Unknown allocation policy %s\n", policy);
+	for (i = 0; i < NUM_POLICIES; i++)
+		if (strcmp(policies[i].name, mm_policy()) == 0)
+			mm_speed = policies[i].speed;
+
 	/* Initialize the timing package */
 	init_fsecs();
 
+	/* Calibrate the per-operation timer and allocate the histograms */
+	if (run_latency) {
+		lat_ovhd = op_ovhd();
+		if ((mm_latency = calloc(1, sizeof(latency_t))) == NULL ||
+				(libc_latency = calloc(1, sizeof(latency_t))) == NULL)
+			unix_error("latency calloc in main failed");
+	}
+
+	/* Fall back to plain timing if the kernel won't give us counters */
+	if (run_perf && init_fperf(1) == 0)
+		run_perf = 0;
+
 	/* Initialize the timeout */
 	if (set_timeout) {
 		init_timeout(set_timeout);
@@ -397,10 +789,21 @@ int main(int argc, char **argv)
 				printf("Checking libc malloc for correctness, ");
 			libc_stats[i].valid = eval_libc_valid(trace);
 			if (libc_stats[i].valid) {
+				memset(&speed_params, 0, sizeof(speed_params));
 				speed_params.trace = trace;
+				speed_params.last = trace->num_ops;
 				if (verbose > 1)
 					printf("and performance.\n");
-				libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+				libc_stats[i].ovhd = fsecs(eval_null_speed, &speed_params);
+				replay_failures = 0;
+				libc_stats[i].secs = less_ovhd(fsecs(eval_libc_speed,
+							&speed_params), libc_stats[i].ovhd,
+						&libc_stats[i].noisy);
+				libc_stats[i].valid = (replay_failures == 0);
+				if (run_latency)
+					eval_libc_latency(trace, libc_latency);
+				if (run_perf)
+					fperf(eval_libc_speed, &speed_params, libc_stats[i].perf);
 			}
 			free_trace(trace);
 		}
@@ -409,6 +812,10 @@ int main(int argc, char **argv)
 		if (verbose) {
 			printf("\nResults for libc malloc:\n");
 			printresults(num_tracefiles, libc_stats);
+			if (run_latency)
+				printlatency("libc", libc_latency);
+			if (run_perf)
+				printperf(num_tracefiles, libc_stats);
 		}
 	}
 
@@ -426,6 +833,30 @@ int main(int argc, char **argv)
 	/* Initialize the simulated memory system in memlib.c */
 	mem_init();
 
+	/* With -p all, run every policy on every trace and compare them */
+	if (sweep) {
+		if ((sweep_stats = calloc(NUM_POLICIES, sizeof(stats_t *))) == NULL)
+			unix_error("sweep_stats calloc in main failed");
+		for (i = 0; i < NUM_POLICIES; i++) {
+			if (verbose > 1)
+				printf("\nTesting mm malloc, policy %s\n", policies[i].name);
+			sweep_stats[i] = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+			if (sweep_stats[i] == NULL)
+				unix_error("sweep_stats calloc in main failed");
+			mm_set_policy(policies[i].name);
+			mm_speed = policies[i].speed;
+			run_tests(num_tracefiles, trace_from_stdin, tracedir, tracefiles,
+					sweep_stats[i], ranges, &speed_params);
+		}
+		for (i = 0; i < NUM_POLICIES; i++)
+			names[i] = policies[i].name;
+		printmatrix("Policy sweep", NUM_POLICIES, names, num_tracefiles,
+				sweep_stats);
+		if (timeline != NULL && fclose(timeline) != 0)
+			unix_error("Could not write timeline file");
+		exit(errors ? 1 : 0);
+	}
+
 	run_tests(num_tracefiles, trace_from_stdin, tracedir, tracefiles,
 			mm_stats, ranges, &speed_params);
 
@@ -442,10 +873,53 @@ int main(int argc, char **argv)
 		} else {
 			printf("\nResults for mm malloc:\n");
 			printresults(num_tracefiles, mm_stats);
+			printrefs(num_tracefiles, mm_stats);
+			if (run_latency)
+				printlatency("mm", mm_latency);
+			if (run_perf)
+				printperf(num_tracefiles, mm_stats);
+			if (bench_samples > 0)
+				printbench(num_tracefiles, mm_stats);
 			printf("\n");
 		}
 	}
 
+	/* Run every backend on every trace, and compare them with mm */
+	if (num_backends > 0 && !onetime_flag) {
+		if ((backend_stats = calloc(num_backends + 1, sizeof(stats_t *)))
+				== NULL)
+			unix_error("backend_stats calloc in main failed");
+		backend_stats[0] = mm_stats;
+		names[0] = "mm";
+		for (i = 0; i < num_backends; i++) {
+			int j;
+
+			if (verbose > 1)
+				printf("\nTesting backend %s\n", backends[i].name);
+			backend_stats[i + 1] = calloc(num_tracefiles, sizeof(stats_t));
+			if (backend_stats[i + 1] == NULL)
+				unix_error("backend_stats calloc in main failed");
+			names[i + 1] = backends[i].name;
+			for (j = 0; j < num_tracefiles; j++) {
+				trace_t *trace = read_trace(&backend_stats[i + 1][j],
+						tracedir, tracefiles[j]);
+				eval_backend(&backends[i], trace, &backend_stats[i + 1][j]);
+				free_trace(trace);
+			}
+		}
+		printmatrix("Backends", num_backends + 1, names, num_tracefiles,
+				backend_stats);
+		printf("\n");
+	}
+
+	/* Save the samples and/or test them against a baseline build */
+	if (bench_save)
+		save_samples(bench_save, num_tracefiles, mm_stats);
+	if (bench_base)
+		regressions = compare_samples(bench_base, num_tracefiles, mm_stats);
+	if (timeline != NULL && fclose(timeline) != 0)
+		unix_error("Could not write timeline file");
+
 	/*
 	 * Accumulate the aggregate statistics for the student's mm package
 	 */
@@ -504,6 +978,10 @@ int main(int argc, char **argv)
 		printf("Terminated with %d errors\n", errors);
 	}
 
+	if (results_file)
+		save_results(results_file, num_tracefiles, mm_stats, avg_mm_util,
+				avg_mm_throughput, p1, p2);
+
 	if (autograder) {
 		printf("correct:%d\n", numcorrect);
 		printf("perfidx:%.0f\n", perfindex);
@@ -515,24 +993,28 @@ int main(int argc, char **argv)
 			avg_mm_throughput/1000.0, avg_mm_util*100);
 	driver_post(NULL, autoresult, autograder, status_msg);
 
-	exit(0);
+	/* Under -C an invalid trace fails the comparison too */
+	exit(regressions ? EXIT_REGRESSION : (bench_base && errors) ? 1 : 0);
 }
 
 
 /*****************************************************************
  * The following routines manipulate the range list, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range list, and the payload map that mirrors it, to detect any
+ * overlapping allocated blocks.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     size bytes at addr lo, aligned to align bytes (ALIGNMENT unless
+ *     the request was a memalign). After checking the block for
+ *     correctness, we create a range struct for this block and add it
+ *     to the range list.
  */
-static int add_range(range_t **ranges, char *lo, int size,
-		const trace_t *trace, int opnum, int index)
+static int add_range(range_t **ranges, char *lo, int size, size_t align,
+		trace_t *trace, int opnum, int index)
 {
 	char *hi = lo + size - 1;
 	range_t *p;
@@ -545,6 +1027,12 @@ static int add_range(range_t **ranges, char *lo, int size,
 				"Payload address (%p) not aligned to %d bytes", lo, ALIGNMENT);
 		return 0;
 	}
+	if (align > ALIGNMENT && ((unsigned long)lo & (align - 1)) != 0) {
+		malloc_error(trace, opnum,
+				"Payload address (%p) not aligned to %lu bytes as requested",
+				lo, (unsigned long)align);
+		return 0;
+	}
 
 	/* The payload must lie within the extent of the heap */
 	if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
@@ -555,19 +1043,21 @@ static int add_range(range_t **ranges, char *lo, int size,
 		return 0;
 	}
 
-	/* If we can't afford the linear-time loop, we check less thoroughly and
-	   just assume the overlap will be caught by writing random bits. */
+	/* If we don't keep ranges, we check less thoroughly and just
+	   assume the overlap will be caught by writing random bits. */
 	if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
 
 
-	/* The payload must not overlap any other payloads */
-	for (p = *ranges;  p != NULL;  p = p->next) {
-		if ((lo >= p->lo && lo <= p-> hi) ||
-				(hi >= p->lo && hi <= p->hi)) {
-			malloc_error(trace, opnum,
-					"Payload (%p:%p) overlaps another payload (%p:%p)\n",
-					lo, hi, p->lo, p->hi);
-			return 0;
+	/* The payload must not overlap any other payloads; the map says
+	   whether it does, and the list which one it is */
+	if (payload_span(lo, hi, SPAN_TEST)) {
+		for (p = *ranges;  p != NULL;  p = p->next) {
+			if (lo <= p->hi && hi >= p->lo) {
+				malloc_error(trace, opnum,
+						"Payload (%p:%p) overlaps another payload (%p:%p)\n",
+						lo, hi, p->lo, p->hi);
+				return 0;
+			}
 		}
 	}
 
@@ -578,36 +1068,42 @@ static int add_range(range_t **ranges, char *lo, int size,
 	if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 		unix_error("malloc error in add_range");
 	p->next = *ranges;
+	p->prev = NULL;
+	if (p->next != NULL)
+		p->next->prev = p;
 	p->lo = lo;
 	p->hi = hi;
 	p->index = index;
 	*ranges = p;
+	trace->block_ranges[index] = p;
+	payload_span(lo, hi, SPAN_SET);
 
 	return 1;
 }
 
 /*
- * remove_range - Free the range record of block whose payload starts at lo
+ * remove_range - Free the range record of block index, if it has one
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(range_t **ranges, trace_t *trace, int index)
 {
-	range_t *p;
-	range_t **prevpp = ranges;
-	int size;
-
-	for (p = *ranges;  p != NULL; p = p->next) {
-		if (p->lo == lo) {
-			*prevpp = p->next;
-			size = p->hi - p->lo + 1;
-			free(p);
-			break;
-		}
-		prevpp = &(p->next);
-	}
+	range_t *p = trace->block_ranges[index];
+
+	if (p == NULL)
+		return;
+	if (p->prev != NULL)
+		p->prev->next = p->next;
+	else
+		*ranges = p->next;
+	if (p->next != NULL)
+		p->next->prev = p->prev;
+	payload_span(p->lo, p->hi, SPAN_CLEAR);
+	trace->block_ranges[index] = NULL;
+	free(p);
 }
 
 /*
- * clear_ranges - free all of the range records for a trace
+ * clear_ranges - free all of the range records for a trace, and
+ *     forget every payload in the map, listed or not
  */
 static void clear_ranges(range_t **ranges)
 {
@@ -619,6 +1115,36 @@ static void clear_ranges(range_t **ranges)
 		free(p);
 	}
 	*ranges = NULL;
+	memset(payload_map, 0, payload_map_words * sizeof(*payload_map));
+	payload_map_words = 0;
+}
+
+/*
+ * payload_span - Test, set or clear the payload map bits of lo..hi,
+ *     a part of the heap. Testing returns whether any bit is set.
+ */
+static int payload_span(char *lo, char *hi, int op)
+{
+	size_t first = (lo - (char *)mem_heap_lo()) / ALIGNMENT;
+	size_t last = (hi - (char *)mem_heap_lo()) / ALIGNMENT;
+	size_t w = first / PAYLOAD_BITS;
+	size_t lastw = last / PAYLOAD_BITS;
+	unsigned long mask = ~0UL << (first % PAYLOAD_BITS);
+	unsigned long lastmask = ~0UL >> (PAYLOAD_BITS - 1 - last % PAYLOAD_BITS);
+
+	if (op == SPAN_SET && lastw >= payload_map_words)
+		payload_map_words = lastw + 1;
+	for (; w <= lastw; w++, mask = ~0UL) {
+		if (w == lastw)
+			mask &= lastmask;
+		if (op == SPAN_TEST && (payload_map[w] & mask))
+			return 1;
+		else if (op == SPAN_SET)
+			payload_map[w] |= mask;
+		else if (op == SPAN_CLEAR)
+			payload_map[w] &= ~mask;
+	}
+	return 0;
 }
 
 /**********************************************
@@ -695,10 +1221,6 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 {
 	FILE *tracefile;
 	trace_t *trace;
-	char type[MAXLINE];
-	int index, size;
-	int max_index = 0;
-	int op_index;
 
 	if (verbose > 1)
 		printf("Reading tracefile: %s\n", filename);
@@ -745,41 +1267,14 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 				calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
 		unix_error("malloc 5 failed in read_trace");
 
+	/* and the range record of each block, while it has one */
+	if ((trace->block_ranges =
+				calloc(trace->num_ids, sizeof(*trace->block_ranges))) == NULL)
+		unix_error("malloc 6 failed in read_trace");
 
 	/* read every request line in the trace file */
-	index = 0;
-	op_index = 0;
-	while (fscanf(tracefile, "%s", type) != EOF) {
-		switch(type[0]) {
-			case 'a':
-				fscanf(tracefile, "%u %u", &index, &size);
-				trace->ops[op_index].type = ALLOC;
-				trace->ops[op_index].index = index;
-				trace->ops[op_index].size = size;
-				max_index = (index > max_index) ? index : max_index;
-				break;
-			case 'r':
-				fscanf(tracefile, "%u %u", &index, &size);
-				trace->ops[op_index].type = REALLOC;
-				trace->ops[op_index].index = index;
-				trace->ops[op_index].size = size;
-				max_index = (index > max_index) ? index : max_index;
-				break;
-			case 'f':
-				fscanf(tracefile, "%ud", &index);
-				trace->ops[op_index].type = FREE;
-				trace->ops[op_index].index = index;
-				break;
-			default:
-				app_error("Bogus type character (%c) in tracefile %s\n",
-						type[0], trace->filename);
-		}
-		op_index++;
-		if(op_index == trace->num_ops) break;
-	}
+	read_ops(tracefile, trace);
 	fclose(tracefile);
-	assert(max_index == trace->num_ids - 1);
-	assert(trace->num_ops == op_index);
 
 	/* fill in the stats */
 	strcpy(stats->filename, trace->filename);
@@ -796,10 +1291,6 @@ static trace_t *read_trace_stdin(stats_t *stats)
 {
 	FILE *tracefile;
 	trace_t *trace;
-	char type[MAXLINE];
-	int index, size;
-	int max_index = 0;
-	int op_index;
 
 	if (verbose > 1)
 		printf("Reading tracefile from stdin\n");
@@ -844,11 +1335,48 @@ static trace_t *read_trace_stdin(stats_t *stats)
 				calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
 		unix_error("malloc 5 failed in read_trace");
 
+	/* and the range record of each block, while it has one */
+	if ((trace->block_ranges =
+				calloc(trace->num_ids, sizeof(*trace->block_ranges))) == NULL)
+		unix_error("malloc 6 failed in read_trace");
 
 	/* read every request line in the trace file */
+	read_ops(tracefile, trace);
+	fclose(tracefile);
+
+	/* fill in the stats */
+	strcpy(stats->filename, "stdin");
+	stats->weight = trace->weight;
+	stats->ops = trace->num_ops;
+
+	return trace;
+}
+
+/*
+ * read_ops - read the request lines of a trace whose header has
+ *     already been read into trace
+ */
+static void read_ops(FILE *tracefile, trace_t *trace)
+{
+	char type[MAXLINE];
+	int index, size, align, count, i;
+	int max_index = 0;
+	int op_index;
+	size_t *cur_size;   /* size of each block so far, for sized frees */
+	int *arena_head = NULL;  /* newest object in each arena scope, -1 if
+	                            none, ARENA_CLOSED if not open */
+	int arena;
+
+	if ((cur_size = calloc(trace->num_ids, sizeof(size_t))) == NULL ||
+			(trace->arena_next = malloc(trace->num_ids * sizeof(int))) == NULL)
+		unix_error("malloc failed in read_ops");
+	trace->num_arenas = 0;
+	trace->arenas = NULL;
+
 	index = 0;
 	op_index = 0;
 	while (fscanf(tracefile, "%s", type) != EOF) {
+		trace->ops[op_index].count = 1;
 		switch(type[0]) {
 			case 'a':
 				fscanf(tracefile, "%u %u", &index, &size);
@@ -864,28 +1392,153 @@ static trace_t *read_trace_stdin(stats_t *stats)
 				trace->ops[op_index].size = size;
 				max_index = (index > max_index) ? index : max_index;
 				break;
+			case 'B':
+				fscanf(tracefile, "%u %u %u", &index, &count, &size);
+				if (count < 1)
+					app_error("%s: empty batch", trace->filename);
+				trace->ops[op_index].type = MALLOC_BATCH;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].count = count;
+				trace->ops[op_index].size = size;
+				max_index = (index + count - 1 > max_index) ?
+					index + count - 1 : max_index;
+				break;
+			case 's':
+				fscanf(tracefile, "%u", &index);
+				trace->ops[op_index].type = SIZED_FREE;
+				trace->ops[op_index].index = index;
+				break;
+			case 'F':
+				fscanf(tracefile, "%u %u", &index, &count);
+				if (count < 1)
+					app_error("%s: empty batch", trace->filename);
+				trace->ops[op_index].type = FREE_BATCH;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].count = count;
+				break;
+			case 'm':
+				fscanf(tracefile, "%u %u %u", &index, &size, &align);
+				if (align <= 0 || (align & (align - 1)) != 0)
+					app_error("%s: alignment %d is not a power of two",
+							trace->filename, align);
+				trace->ops[op_index].type = MEMALIGN;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				trace->ops[op_index].align = align;
+				max_index = (index > max_index) ? index : max_index;
+				break;
 			case 'f':
 				fscanf(tracefile, "%ud", &index);
 				trace->ops[op_index].type = FREE;
 				trace->ops[op_index].index = index;
 				break;
+			case 'A':
+			case 'R':
+			case 'D':
+				fscanf(tracefile, "%u", &arena);
+				if (arena < 0 || arena > trace->num_arenas)
+					app_error("%s: arena %d opened out of order",
+							trace->filename, arena);
+				if (arena == trace->num_arenas) {
+					trace->num_arenas++;
+					if ((arena_head = realloc(arena_head,
+									trace->num_arenas * sizeof(int))) == NULL)
+						unix_error("malloc failed in read_ops");
+					arena_head[arena] = ARENA_CLOSED;
+				}
+				if ((type[0] == 'A') != (arena_head[arena] == ARENA_CLOSED))
+					app_error("%s: arena %d is %s", trace->filename, arena,
+							(type[0] == 'A') ? "already open" : "not open");
+				trace->ops[op_index].type = (type[0] == 'A') ? ARENA_CREATE :
+					(type[0] == 'R') ? ARENA_RESET : ARENA_DESTROY;
+				trace->ops[op_index].arena = arena;
+
+				/* A reset or destroy ends the scope: remember its objects */
+				index = (type[0] == 'A') ? -1 : arena_head[arena];
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].count = 0;
+				arena_head[arena] = (type[0] == 'D') ? ARENA_CLOSED : -1;
+				break;
+			case 'n':
+				fscanf(tracefile, "%u %u %u", &arena, &index, &size);
+				if (arena < 0 || arena >= trace->num_arenas ||
+						arena_head[arena] == ARENA_CLOSED)
+					app_error("%s: arena %d is not open",
+							trace->filename, arena);
+				trace->ops[op_index].type = ARENA_ALLOC;
+				trace->ops[op_index].arena = arena;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
 			default:
-				app_error("Bogus type character (%c) from stdin\n",
-						type[0]);
+				app_error("Bogus type character (%c) in tracefile %s\n",
+						type[0], trace->filename);
 		}
+		if ((index < 0 && trace->ops[op_index].type != FREE &&
+					trace->ops[op_index].count > 0) ||
+				index + trace->ops[op_index].count > trace->num_ids)
+			app_error("%s: block id %d out of range", trace->filename,
+					index + trace->ops[op_index].count - 1);
+
+		/* Track block sizes, so a sized free knows its size */
+		if (trace->ops[op_index].type == SIZED_FREE)
+			trace->ops[op_index].size = cur_size[index];
+		else if (trace->ops[op_index].type != FREE &&
+				trace->ops[op_index].type != FREE_BATCH)
+			for (i = 0; i < trace->ops[op_index].count; i++)
+				cur_size[index + i] = trace->ops[op_index].size;
+		if (trace->ops[op_index].type == ARENA_ALLOC) {
+			trace->arena_next[index] = arena_head[arena];
+			arena_head[arena] = index;
+		}
+
 		op_index++;
 		if(op_index == trace->num_ops) break;
 	}
-	fclose(tracefile);
+	free(cur_size);
+	free(arena_head);
+	if (trace->num_arenas > 0 && (trace->arenas =
+				calloc(trace->num_arenas, sizeof(mm_arena_t *))) == NULL)
+		unix_error("malloc failed in read_ops");
 	assert(max_index == trace->num_ids - 1);
 	assert(trace->num_ops == op_index);
+	pack_ops(trace);
+}
 
-	/* fill in the stats */
-	strcpy(stats->filename, "stdin");
-	stats->weight = trace->weight;
-	stats->ops = trace->num_ops;
-
-	return trace;
+/*
+ * pack_ops - Encode the requests for the timed replay, with
+ *     PREFETCH_DIST zero words at the end so that the prefetch
+ *     needs no bounds check
+ */
+static void pack_ops(trace_t *trace)
+{
+	traceop_t *op;
+	int i, type;
+
+	if ((trace->packed = calloc(trace->num_ops + PREFETCH_DIST,
+					sizeof(*trace->packed))) == NULL)
+		unix_error("malloc failed in pack_ops");
+	for (i = 0; i < trace->num_ops; i++) {
+		op = &trace->ops[i];
+		type = (op->type == ALLOC) ? OP_ALLOC :
+			(op->type == FREE) ? OP_FREE :
+			(op->type == REALLOC) ? OP_REALLOC :
+			(op->type == SIZED_FREE) ? OP_SIZED_FREE :
+			(op->type == ARENA_ALLOC) ? OP_ARENA_ALLOC : OP_OTHER;
+		if (op->index < 0 || op->index > OP_MAX_INDEX ||
+				op->size > OP_MAX_SIZE)
+			type = OP_OTHER;
+		if (type == OP_ARENA_ALLOC && (op->arena > OP_MAX_ARENA ||
+					op->size > OP_MAX_ARENA_SIZE))
+			type = OP_OTHER;
+		trace->packed[i] = PACK_OP(type,
+				(op->index >= 0 && op->index <= OP_MAX_INDEX) ? op->index : 0,
+				(type == OP_OTHER) ? 0 :
+				(type == OP_ARENA_ALLOC) ?
+				(size_t)op->arena << (32 - OP_ARENA_BITS) | op->size :
+				op->size);
+	}
 }
 
 /*
@@ -899,15 +1552,20 @@ static void reinit_trace(trace_t *trace)
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_trace - Free the trace record and the arrays it points
+ *              to, all of which were allocated in read_trace() and
+ *              read_ops().
  */
 static void free_trace(trace_t *trace)
 {
-	free(trace->ops);         /* free the three arrays... */
+	free(trace->ops);         /* free the arrays... */
+	free(trace->packed);
 	free(trace->blocks);
 	free(trace->block_sizes);
 	free(trace->block_rand_base);
+	free(trace->block_ranges);
+	free(trace->arena_next);
+	free(trace->arenas);
 	free(trace);              /* and the trace record itself... */
 }
 
@@ -917,9 +1575,11 @@ static void free_trace(trace_t *trace)
  **********************************************************************/
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * eval_mm_valid - Check the mm malloc package for correctness. If
+ *   util isn't NULL, also keep the high-water mark of eval_mm_util and
+ *   store the utilization there, sparing that function its own run.
  */
-static int eval_mm_valid(trace_t *trace, range_t **ranges)
+static int eval_mm_valid(trace_t *trace, range_t **ranges, double *util)
 {
 	int i;
 	int index;
@@ -927,11 +1587,16 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 	char *newp;
 	char *oldp;
 	char *p;
+	int j, n;
+	int max_total_size = 0;
+	int total_size = 0;
 
 	/* Reset the heap and free any records in the range list */
 	mem_reset_brk();
 	clear_ranges(ranges);
 	reinit_trace(trace);
+	memset(trace->block_ranges, 0,
+			trace->num_ids * sizeof(*trace->block_ranges));
 
 	/* Call the mm package's init function */
 	if (mm_init() < 0) {
@@ -973,17 +1638,37 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				 * to the range list if OK. The block must be  be aligned properly,
 				 * and must not overlap any currently allocated block.
 				 */
-				if (add_range(ranges, p, size, trace, i, index) == 0)
+				if (add_range(ranges, p, size, ALIGNMENT, trace, i, index) == 0)
 					return 0;
 
 				/* Remember region */
 				trace->blocks[index] = p;
 				trace->block_sizes[index] = size;
+				total_size += size;
 
 				/* Set to random data, for debugging. */
 				randomize_block(trace, index);
 				break;
 
+			case MEMALIGN: /* mm_memalign */
+
+				/* Call the student's memalign */
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+					malloc_error(trace, i, "mm_memalign failed.");
+					return 0;
+				}
+
+				/* Same checks as malloc, plus the requested alignment */
+				if (add_range(ranges, p, size, trace->ops[i].align,
+							trace, i, index) == 0)
+					return 0;
+
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				total_size += size;
+				randomize_block(trace, index);
+				break;
+
 			case REALLOC: /* mm_realloc */
 				check_index(trace, i, index);
 
@@ -1002,11 +1687,11 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
 
 				/* Remove the old region from the range list */
-				remove_range(ranges, oldp);
+				remove_range(ranges, trace, index);
 
 				/* Check new block for correctness and add it to range list */
 				if (size > 0) {
-					if(add_range(ranges, newp, size, trace, i, index) == 0)
+					if(add_range(ranges, newp, size, ALIGNMENT, trace, i, index) == 0)
 						return 0;
 				}
 
@@ -1014,6 +1699,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				/* Move the region from where it was.
 				 * Check up to min(size, oldsize) for correct copying. */
 				trace->blocks[index] = newp;
+				total_size += (int)size - (int)trace->block_sizes[index];
 				if(size < trace->block_sizes[index]) {
 					trace->block_sizes[index] = size;
 				}
@@ -1032,15 +1718,106 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 					p = 0;
 				} else {
 					p = trace->blocks[index];
-					remove_range(ranges, p);
+					remove_range(ranges, trace, index);
+					total_size -= trace->block_sizes[index];
 				}
 				mm_free(p);
 				break;
 
+			case SIZED_FREE: /* mm_free_sized */
+				check_index(trace, i, index);
+				p = trace->blocks[index];
+				remove_range(ranges, trace, index);
+				total_size -= trace->block_sizes[index];
+				mm_free_sized(p, size);
+				break;
+
+			case MALLOC_BATCH: /* mm_malloc_batch */
+				n = trace->ops[i].count;
+				if (mm_malloc_batch(n, size, (void **)&trace->blocks[index])
+						!= (size_t)n) {
+					malloc_error(trace, i, "mm_malloc_batch failed.");
+					return 0;
+				}
+
+				/* Check every block of the batch as if malloc'ed alone */
+				for (j = index; j < index + n; j++) {
+					if (add_range(ranges, trace->blocks[j], size, ALIGNMENT,
+								trace, i, j) == 0)
+						return 0;
+					trace->block_sizes[j] = size;
+					randomize_block(trace, j);
+				}
+				total_size += n * size;
+				break;
+
+			case FREE_BATCH: /* mm_free_batch */
+				n = trace->ops[i].count;
+				for (j = index; j < index + n; j++) {
+					check_index(trace, i, j);
+					remove_range(ranges, trace, j);
+					total_size -= trace->block_sizes[j];
+				}
+				mm_free_batch(n, (void **)&trace->blocks[index]);
+				break;
+
+			case ARENA_CREATE: /* mm_arena_create */
+				if ((trace->arenas[trace->ops[i].arena] =
+							mm_arena_create()) == NULL) {
+					malloc_error(trace, i, "mm_arena_create failed.");
+					return 0;
+				}
+				break;
+
+			case ARENA_ALLOC: /* mm_arena_alloc */
+				if ((p = mm_arena_alloc(trace->arenas[trace->ops[i].arena],
+								size)) == NULL) {
+					malloc_error(trace, i, "mm_arena_alloc failed.");
+					return 0;
+				}
+
+				/* Same checks as malloc */
+				if (add_range(ranges, p, size, ALIGNMENT, trace, i, index) == 0)
+					return 0;
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				total_size += size;
+				randomize_block(trace, index);
+				break;
+
+			case ARENA_RESET: /* mm_arena_reset */
+			case ARENA_DESTROY: /* mm_arena_destroy */
+
+				/* Every object of the scope dies */
+				for (j = index; j >= 0; j = trace->arena_next[j]) {
+					check_index(trace, i, j);
+					remove_range(ranges, trace, j);
+					total_size -= trace->block_sizes[j];
+				}
+				if (trace->ops[i].type == ARENA_RESET)
+					mm_arena_reset(trace->arenas[trace->ops[i].arena]);
+				else
+					mm_arena_destroy(trace->arenas[trace->ops[i].arena]);
+				break;
+
 			default:
 				app_error("Nonexistent request type in eval_mm_valid");
 		}
 
+		/* update the high-water mark, as eval_mm_util does */
+		if (util != NULL) {
+			max_total_size = (total_size > max_total_size) ?
+				total_size : max_total_size;
+
+			if (timeline != NULL &&
+					(i % timeline_every == 0 || i == trace->num_ops - 1))
+				sample_heap(timeline, trace, i, total_size);
+		}
+	}
+
+	if (util != NULL) {
+		printf(".");
+		*util = (double)max_total_size / (double)mem_peak_heapsize();
 	}
 
 	/* As far as we know, this is a valid malloc package */
@@ -1068,6 +1845,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 	int total_size = 0;
 	char *p;
 	char *newp, *oldp;
+	int j, n;
 
 	reinit_trace(trace);
 
@@ -1095,10 +1873,25 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 				total_size += size;
 				break;
 
-			case REALLOC: /* mm_realloc */
+			case MEMALIGN: /* mm_memalign */
 				index = trace->ops[i].index;
-				newsize = trace->ops[i].size;
-				oldsize = trace->block_sizes[index];
+				size = trace->ops[i].size;
+
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+					app_error("trace %d: mm_memalign failed in eval_mm_util",
+							tracenum);
+				}
+
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+
+				total_size += size;
+				break;
+
+			case REALLOC: /* mm_realloc */
+				index = trace->ops[i].index;
+				newsize = trace->ops[i].size;
+				oldsize = trace->block_sizes[index];
 
 				oldp = trace->blocks[index];
 				if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0) {
@@ -1128,167 +1921,1461 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 				total_size -= size;
 				break;
 
+			case SIZED_FREE: /* mm_free_sized */
+				index = trace->ops[i].index;
+				size = trace->block_sizes[index];
+				mm_free_sized(trace->blocks[index], size);
+				total_size -= size;
+				break;
+
+			case MALLOC_BATCH: /* mm_malloc_batch */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				n = trace->ops[i].count;
+				if (mm_malloc_batch(n, size, (void **)&trace->blocks[index])
+						!= (size_t)n) {
+					app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+							tracenum);
+				}
+				for (j = index; j < index + n; j++)
+					trace->block_sizes[j] = size;
+				total_size += n * size;
+				break;
+
+			case FREE_BATCH: /* mm_free_batch */
+				index = trace->ops[i].index;
+				n = trace->ops[i].count;
+				for (j = index; j < index + n; j++)
+					total_size -= trace->block_sizes[j];
+				mm_free_batch(n, (void **)&trace->blocks[index]);
+				break;
+
+			case ARENA_CREATE: /* mm_arena_create */
+				if ((trace->arenas[trace->ops[i].arena] =
+							mm_arena_create()) == NULL) {
+					app_error("trace %d: mm_arena_create failed in eval_mm_util",
+							tracenum);
+				}
+				break;
+
+			case ARENA_ALLOC: /* mm_arena_alloc */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = mm_arena_alloc(trace->arenas[trace->ops[i].arena],
+								size)) == NULL) {
+					app_error("trace %d: mm_arena_alloc failed in eval_mm_util",
+							tracenum);
+				}
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				total_size += size;
+				break;
+
+			case ARENA_RESET: /* mm_arena_reset */
+			case ARENA_DESTROY: /* mm_arena_destroy */
+				for (j = trace->ops[i].index; j >= 0; j = trace->arena_next[j])
+					total_size -= trace->block_sizes[j];
+				if (trace->ops[i].type == ARENA_RESET)
+					mm_arena_reset(trace->arenas[trace->ops[i].arena]);
+				else
+					mm_arena_destroy(trace->arenas[trace->ops[i].arena]);
+				break;
+
 			default:
 				app_error("trace %d: Nonexistent request type in eval_mm_util",
 						tracenum);
 		}
 
-		/* update the high-water mark */
-		max_total_size = (total_size > max_total_size) ?
-			total_size : max_total_size;
+		/* update the high-water mark */
+		max_total_size = (total_size > max_total_size) ?
+			total_size : max_total_size;
+
+		if (timeline != NULL &&
+				(i % timeline_every == 0 || i == trace->num_ops - 1))
+			sample_heap(timeline, trace, i, total_size);
+	}
+
+	printf(".");
+
+	/* the heap may have been trimmed since; it cost its peak size */
+	return ((double)max_total_size / (double)mem_peak_heapsize());
+}
+
+
+/*
+ * timeline_header - Write the column names of the -T timeline to out
+ */
+static void timeline_header(FILE *out)
+{
+	int i;
+
+	fprintf(out, "trace,policy,op,requested,heap,overhead,"
+			"alloc_blocks,alloc_bytes,quick_blocks,quick_bytes,"
+			"free_blocks,free_bytes,largest_free,util,"
+			"internal_frag,external_frag");
+	for (i = 0; i < MM_STATS_BINS - 1; i++)
+		fprintf(out, ",free_lt%lu", 32UL << i);
+	fprintf(out, ",free_ge%lu", 32UL << (MM_STATS_BINS - 2));
+	fprintf(out, "\n");
+}
+
+/*
+ * sample_heap - Write one line of the -T timeline to out: the heap
+ *    after request opnum, when the live blocks add up to requested bytes.
+ *    Internal fragmentation compares those bytes with the blocks
+ *    that hold them; external fragmentation is what mm_heap_stats
+ *    reports for the free blocks.
+ */
+static void sample_heap(FILE *out, trace_t *trace, int opnum, int requested)
+{
+	mm_heap_stats_t st;
+	int i;
+
+	mm_heap_stats(&st);
+	fprintf(out, "%s,%s,%d,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,"
+			"%.4f,%.4f,%.4f",
+			trace->filename, mm_policy(), opnum, requested,
+			(unsigned long)st.heap_bytes, (unsigned long)st.overhead_bytes,
+			(unsigned long)st.alloc_blocks, (unsigned long)st.alloc_bytes,
+			(unsigned long)st.quick_blocks, (unsigned long)st.quick_bytes,
+			(unsigned long)st.free_blocks, (unsigned long)st.free_bytes,
+			(unsigned long)st.largest_free,
+			st.heap_bytes ? (double)requested / st.heap_bytes : 0,
+			st.alloc_bytes ? 1 - (double)requested / st.alloc_bytes : 0,
+			st.external_frag);
+	for (i = 0; i < MM_STATS_BINS; i++)
+		fprintf(out, ",%lu", (unsigned long)st.bin_blocks[i]);
+	fprintf(out, "\n");
+}
+
+/*
+ * replay_failed - Note that an allocator other than mm failed request i
+ *    in a timed replay. The replay goes on, with a NULL block, and the
+ *    caller marks the trace invalid.
+ */
+static __attribute__((noinline, cold)) void replay_failed(trace_t *trace,
+		int i)
+{
+	if (replay_failures++ == 0)
+		malloc_error(trace, i, "%s failed the request in a timed replay",
+				backend != NULL ? backend->name : "allocator");
+}
+
+/*
+ * replay_mm - The body of eval_mm_speed, with malloc, free and realloc
+ *    passed in. It is always inlined, so with constant arguments the
+ *    calls are direct: eval_mm_speed_<policy> calls the entry points
+ *    that have the policy compiled in. The loop reads the packed
+ *    requests and leaves the rare ones to do_other, replay_other for
+ *    mm. A reference allocator passes its own functions instead: there
+ *    is no mm heap, sized frees and arena allocations go to do_free
+ *    and do_malloc, and a NULL do_other skips the rare requests.
+ */
+static inline __attribute__((always_inline))
+void replay_mm(void *ptr, void *(*do_malloc)(size_t),
+		void (*do_free)(void *), void *(*do_realloc)(void *, size_t),
+		void (*do_other)(trace_t *, int))
+{
+	int i;
+	uint64_t op;
+	char *p;
+	speed_t *sp = (speed_t *)ptr;
+	trace_t *trace = sp->trace;
+	const uint64_t *packed = trace->packed;
+	char **blocks = trace->blocks;
+	mm_arena_t **arenas = trace->arenas;
+	int mm = (do_other == replay_other);
+
+	/* Start from an empty heap, or from the one warm_mm saved */
+	if (sp->first == 0) {
+		reinit_trace(trace);
+		if (mm) {
+			mem_reset_brk();
+			if (mm_init() < 0)
+				app_error("mm_init failed in eval_mm_speed");
+		}
+	} else if (mm && !sp->restored) {
+		restore_mm(sp);
+	}
+	if (mm)
+		sp->restored = 0;
+
+	/* Interpret each trace request */
+	for (i = sp->first;  i < sp->last;  i++) {
+		op = packed[i];
+		__builtin_prefetch(&blocks[OP_INDEX(packed[i + PREFETCH_DIST])], 1);
+		switch (OP_TYPE(op)) {
+
+			case OP_ALLOC: /* mm_malloc */
+				if ((p = do_malloc(OP_SIZE(op))) == NULL) {
+					if (mm)
+						app_error("mm_malloc error in eval_mm_speed");
+					replay_failed(trace, i);
+				}
+				blocks[OP_INDEX(op)] = p;
+				break;
+
+			case OP_FREE: /* mm_free */
+				do_free(blocks[OP_INDEX(op)]);
+				break;
+
+			case OP_REALLOC: /* mm_realloc */
+				if ((p = do_realloc(blocks[OP_INDEX(op)], OP_SIZE(op))) == NULL
+						&& OP_SIZE(op) != 0) {
+					if (mm)
+						app_error("mm_realloc error in eval_mm_speed");
+					replay_failed(trace, i);
+				}
+				blocks[OP_INDEX(op)] = p;
+				break;
+
+			case OP_SIZED_FREE: /* mm_free_sized */
+				if (!mm)
+					do_free(blocks[OP_INDEX(op)]);
+				else
+					mm_free_sized(blocks[OP_INDEX(op)], OP_SIZE(op));
+				break;
+
+			case OP_ARENA_ALLOC: /* mm_arena_alloc */
+				p = !mm ? do_malloc(OP_ARENA_SIZE(op)) :
+					mm_arena_alloc(arenas[OP_ARENA(op)], OP_ARENA_SIZE(op));
+				if (p == NULL) {
+					if (mm)
+						app_error("mm_arena_alloc error in eval_mm_speed");
+					replay_failed(trace, i);
+				}
+				blocks[OP_INDEX(op)] = p;
+				break;
+
+			default: /* everything else */
+				if (do_other != NULL)
+					do_other(trace, i);
+		}
+	}
+}
+
+/*
+ * replay_other - Replay request i of the trace, one that replay_mm
+ *    doesn't handle itself. Kept out of line, off the replay's hot path.
+ */
+static __attribute__((noinline)) void replay_other(trace_t *trace, int i)
+{
+	int index = trace->ops[i].index;
+	size_t size = trace->ops[i].size;
+	char *p;
+
+	switch (trace->ops[i].type) {
+
+		case ALLOC: /* mm_malloc, too big to pack */
+			if ((p = mm_malloc(size)) == NULL)
+				app_error("mm_malloc error in eval_mm_speed");
+			trace->blocks[index] = p;
+			break;
+
+		case MEMALIGN: /* mm_memalign */
+			if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+				app_error("mm_memalign error in eval_mm_speed");
+			trace->blocks[index] = p;
+			break;
+
+		case REALLOC: /* mm_realloc, too big to pack */
+			if ((p = mm_realloc(trace->blocks[index], size)) == NULL &&
+					size != 0)
+				app_error("mm_realloc error in eval_mm_speed");
+			trace->blocks[index] = p;
+			break;
+
+		case FREE: /* mm_free, of NULL if index is -1 */
+			mm_free(index < 0 ? NULL : trace->blocks[index]);
+			break;
+
+		case SIZED_FREE: /* mm_free_sized */
+			mm_free_sized(trace->blocks[index], size);
+			break;
+
+		case MALLOC_BATCH: /* mm_malloc_batch */
+			if (mm_malloc_batch(trace->ops[i].count, size,
+						(void **)&trace->blocks[index])
+					!= (size_t)trace->ops[i].count)
+				app_error("mm_malloc_batch error in eval_mm_speed");
+			break;
+
+		case FREE_BATCH: /* mm_free_batch */
+			mm_free_batch(trace->ops[i].count,
+					(void **)&trace->blocks[index]);
+			break;
+
+		case ARENA_CREATE: /* mm_arena_create */
+			if ((trace->arenas[trace->ops[i].arena] =
+						mm_arena_create()) == NULL)
+				app_error("mm_arena_create error in eval_mm_speed");
+			break;
+
+		case ARENA_ALLOC: /* mm_arena_alloc, too big to pack */
+			if ((p = mm_arena_alloc(trace->arenas[trace->ops[i].arena],
+							size)) == NULL)
+				app_error("mm_arena_alloc error in eval_mm_speed");
+			trace->blocks[index] = p;
+			break;
+
+		case ARENA_RESET: /* mm_arena_reset */
+			mm_arena_reset(trace->arenas[trace->ops[i].arena]);
+			break;
+
+		case ARENA_DESTROY: /* mm_arena_destroy */
+			mm_arena_destroy(trace->arenas[trace->ops[i].arena]);
+			break;
+
+		default:
+			app_error("Nonexistent request type in eval_mm_speed");
+	}
+}
+
+/*
+ * warm_mm - Replay the first -w requests of the trace once and save the
+ *    heap they leave. The timed runs then replay only the rest, each
+ *    after restore_mm, which fsecs runs untimed, has put that heap back.
+ *    Traces that are not longer than -w are timed whole.
+ */
+static void warm_mm(speed_t *sp)
+{
+	trace_t *trace = sp->trace;
+
+	sp->last = warmup;
+	mm_speed(sp);
+	if (mm_snapshot() < 0)
+		unix_error("mm_snapshot failed in warm_mm");
+
+	/* one spare entry each, so that neither size is 0 */
+	if ((sp->warm_blocks = calloc(trace->num_ids + 1, sizeof(char *))) ==
+			NULL || (sp->warm_arenas = calloc(trace->num_arenas + 1,
+					sizeof(mm_arena_t *))) == NULL)
+		unix_error("calloc failed in warm_mm");
+	memcpy(sp->warm_blocks, trace->blocks, trace->num_ids * sizeof(char *));
+	if (trace->num_arenas > 0)
+		memcpy(sp->warm_arenas, trace->arenas,
+				trace->num_arenas * sizeof(mm_arena_t *));
+
+	sp->first = sp->last;
+	sp->last = trace->num_ops;
+	sp->restored = 0;
+	set_fsecs_prepare(restore_mm);
+}
+
+/*
+ * restore_mm - Put back the heap and block pointers saved by warm_mm
+ */
+static void restore_mm(void *ptr)
+{
+	speed_t *sp = (speed_t *)ptr;
+	trace_t *trace = sp->trace;
+
+	if (mm_restore() < 0)
+		unix_error("mm_restore failed");
+	memcpy(trace->blocks, sp->warm_blocks, trace->num_ids * sizeof(char *));
+	if (trace->num_arenas > 0)
+		memcpy(trace->arenas, sp->warm_arenas,
+				trace->num_arenas * sizeof(mm_arena_t *));
+	sp->restored = 1;
+}
+
+/*
+ * unwarm_mm - Go back to timing whole traces after warm_mm
+ */
+static void unwarm_mm(speed_t *sp)
+{
+	set_fsecs_prepare(NULL);
+	free(sp->warm_blocks);
+	free(sp->warm_arenas);
+	sp->warm_blocks = NULL;
+	sp->warm_arenas = NULL;
+	sp->first = 0;
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+	replay_mm(ptr, mm_malloc, mm_free, mm_realloc, replay_other);
+}
+
+/*
+ * eval_mm_speed_<policy> - eval_mm_speed for a heap under that policy
+ */
+#define POLICY_SPEED(name)                                              \
+	static void eval_mm_speed_##name(void *ptr)                         \
+	{                                                                   \
+		replay_mm(ptr, mm_malloc_##name, mm_free_##name,                \
+				mm_realloc_##name, replay_other);                       \
+	}
+MM_POLICIES(POLICY_SPEED)
+
+/*
+ * null_malloc, null_free, null_realloc - An allocator that does
+ *    nothing, for eval_null_speed. The empty asm keeps the compiler
+ *    from seeing that, so the calls stay in the loop.
+ */
+static char null_block[ALIGNMENT];
+
+static __attribute__((noinline)) void *null_malloc(size_t size)
+{
+	__asm__ volatile("" : : "r"(size) : "memory");
+	return null_block;
+}
+
+static __attribute__((noinline)) void null_free(void *ptr)
+{
+	__asm__ volatile("" : : "r"(ptr) : "memory");
+}
+
+static __attribute__((noinline)) void *null_realloc(void *ptr, size_t size)
+{
+	__asm__ volatile("" : : "r"(ptr), "r"(size) : "memory");
+	return null_block;
+}
+
+/*
+ * less_ovhd - secs without the driver overhead ovhd. What is left is
+ *    noise if it is under OVHD_FLOOR of secs; then *noisy is set and
+ *    that floor is returned, so a time is never negative or the gross.
+ */
+static double less_ovhd(double secs, double ovhd, int *noisy)
+{
+	if (secs - ovhd < secs * OVHD_FLOOR) {
+		*noisy = 1;
+		return secs * OVHD_FLOOR;
+	}
+	return secs - ovhd;
+}
+
+/*
+ * eval_null_speed - eval_mm_speed with the null allocator: what the
+ *    driver itself costs, which run_tests takes off the time of mm
+ */
+static void eval_null_speed(void *ptr)
+{
+	replay_mm(ptr, null_malloc, null_free, null_realloc, NULL);
+}
+
+/*
+ * bump_malloc, bump_free, bump_realloc - An allocator that never
+ *    frees, for eval_bump_speed: each block goes after the last one in
+ *    the region eval_refs maps, behind a word with its size. Realloc
+ *    grows the last block in place and copies any other.
+ */
+static char *bump_lo, *bump_next;
+static char *bump_warm;           /* bump_next after the -w requests */
+static char **bump_warm_blocks;   /* trace->blocks then */
+
+static __attribute__((noinline)) void *bump_malloc(size_t size)
+{
+	char *p = bump_next;
+
+	bump_next += BUMP_HDR + ALIGN_UP(size);
+	*(size_t *)p = size;
+	return p + BUMP_HDR;
+}
+
+static __attribute__((noinline)) void bump_free(void *ptr)
+{
+	__asm__ volatile("" : : "r"(ptr) : "memory");
+}
+
+static __attribute__((noinline)) void *bump_realloc(void *ptr, size_t size)
+{
+	size_t oldsize;
+	char *p;
+
+	if (size == 0)
+		return NULL;
+	if (ptr == NULL)
+		return bump_malloc(size);
+	oldsize = *(size_t *)((char *)ptr - BUMP_HDR);
+	if ((char *)ptr + ALIGN_UP(oldsize) == bump_next) {
+		bump_next = (char *)ptr + ALIGN_UP(size);
+		*(size_t *)((char *)ptr - BUMP_HDR) = size;
+		return ptr;
+	}
+	p = bump_malloc(size);
+	memcpy(p, ptr, (oldsize < size) ? oldsize : size);
+	return p;
+}
+
+/*
+ * bump_other - replay_other for the bump allocator. Memalign
+ *    requests get their alignment; frees and arena scopes are no-ops.
+ */
+static void bump_other(trace_t *trace, int i)
+{
+	int index = trace->ops[i].index;
+	size_t size = trace->ops[i].size;
+	size_t align = trace->ops[i].align;
+	int j;
+
+	switch (trace->ops[i].type) {
+		case ALLOC:
+		case ARENA_ALLOC:
+			trace->blocks[index] = bump_malloc(size);
+			break;
+
+		case MEMALIGN:
+			bump_next = (char *)((((unsigned long)bump_next + BUMP_HDR +
+								align - 1) & ~(align - 1)) - BUMP_HDR);
+			trace->blocks[index] = bump_malloc(size);
+			break;
+
+		case REALLOC:
+			trace->blocks[index] = bump_realloc(trace->blocks[index], size);
+			break;
+
+		case MALLOC_BATCH:
+			for (j = index; j < index + trace->ops[i].count; j++)
+				trace->blocks[j] = bump_malloc(size);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * eval_bump_speed - eval_mm_speed with the bump allocator: about as
+ *    fast as any allocator can be
+ */
+static void eval_bump_speed(void *ptr)
+{
+	if (((speed_t *)ptr)->first == 0)
+		bump_next = bump_lo;
+	replay_mm(ptr, bump_malloc, bump_free, bump_realloc, bump_other);
+}
+
+/*
+ * restore_bump - Put back the bump region and block pointers the -w
+ *    requests left, as restore_mm does for mm
+ */
+static void restore_bump(void *ptr)
+{
+	speed_t *sp = (speed_t *)ptr;
+
+	memcpy(sp->trace->blocks, bump_warm_blocks,
+			sp->trace->num_ids * sizeof(char *));
+	bump_next = bump_warm;
+}
+
+/*
+ * eval_refs - Time the reference allocators on the requests mm is
+ *    timed on (those after the first -w with -w), and find the utilization of a perfect packer: one that puts the live
+ *    payloads, each rounded up to ALIGNMENT, side by side with no
+ *    headers and no gaps. It is the best any allocator could do.
+ */
+static void eval_refs(trace_t *trace, stats_t *stats)
+{
+	speed_t sp;
+	traceop_t *op;
+	size_t bytes = 0;     /* room the bump allocator needs */
+	size_t total_size = 0, max_total_size = 0;
+	size_t packed_size = 0, max_packed_size = 0;
+	int i, j;
+
+	reinit_trace(trace);
+	for (i = 0; i < trace->num_ops; i++) {
+		op = &trace->ops[i];
+		switch (op->type) {
+			case ALLOC:
+			case MEMALIGN:
+			case ARENA_ALLOC:
+				trace->block_sizes[op->index] = op->size;
+				total_size += op->size;
+				packed_size += ALIGN_UP(op->size);
+				bytes += BUMP_HDR + ALIGN_UP(op->size) +
+					(op->type == MEMALIGN ? op->align : 0);
+				break;
+
+			case REALLOC:
+				total_size += op->size - trace->block_sizes[op->index];
+				packed_size += ALIGN_UP(op->size) -
+					ALIGN_UP(trace->block_sizes[op->index]);
+				trace->block_sizes[op->index] = op->size;
+				bytes += BUMP_HDR + ALIGN_UP(op->size);
+				break;
+
+			case FREE:
+			case SIZED_FREE:
+				if (op->index < 0)
+					break;
+				total_size -= trace->block_sizes[op->index];
+				packed_size -= ALIGN_UP(trace->block_sizes[op->index]);
+				break;
+
+			case MALLOC_BATCH:
+				for (j = op->index; j < op->index + op->count; j++)
+					trace->block_sizes[j] = op->size;
+				total_size += op->count * op->size;
+				packed_size += op->count * ALIGN_UP(op->size);
+				bytes += op->count * (BUMP_HDR + ALIGN_UP(op->size));
+				break;
+
+			case FREE_BATCH:
+				for (j = op->index; j < op->index + op->count; j++) {
+					total_size -= trace->block_sizes[j];
+					packed_size -= ALIGN_UP(trace->block_sizes[j]);
+				}
+				break;
+
+			case ARENA_RESET:
+			case ARENA_DESTROY:
+				for (j = op->index; j >= 0; j = trace->arena_next[j]) {
+					total_size -= trace->block_sizes[j];
+					packed_size -= ALIGN_UP(trace->block_sizes[j]);
+				}
+				break;
+
+			default:
+				break;
+		}
+		if (total_size > max_total_size)
+			max_total_size = total_size;
+		if (packed_size > max_packed_size)
+			max_packed_size = packed_size;
+	}
+	stats->oracle = max_packed_size ?
+		(double)max_total_size / max_packed_size : 0;
+
+	/* Bump allocate from a region of our own, not from the mm heap */
+	if ((bump_lo = mmap(NULL, bytes + BUMP_HDR, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0))
+			== MAP_FAILED)
+		unix_error("mmap failed in eval_refs");
+
+	memset(&sp, 0, sizeof(sp));
+	sp.trace = trace;
+	sp.first = 0;
+	sp.last = trace->num_ops;
+
+	/* With -w, bump replays the first requests once, as warm_mm does */
+	if (warmup > 0 && warmup < trace->num_ops) {
+		sp.last = warmup;
+		eval_bump_speed(&sp);
+		bump_warm = bump_next;
+		if ((bump_warm_blocks = calloc(trace->num_ids + 1,
+						sizeof(char *))) == NULL)
+			unix_error("calloc failed in eval_refs");
+		memcpy(bump_warm_blocks, trace->blocks,
+				trace->num_ids * sizeof(char *));
+		sp.first = sp.last;
+		sp.last = trace->num_ops;
+		set_fsecs_prepare(restore_bump);
+	}
+	stats->ref_ops = sp.last - sp.first;
+	for (i = 0; i < NUM_REFS; i++)
+		stats->ref_secs[i] = fsecs(refs[i].speed, &sp);
+	for (i = 1; i < NUM_REFS; i++)
+		stats->ref_secs[i] = less_ovhd(stats->ref_secs[i],
+				stats->ref_secs[0], &stats->ref_noisy[i]);
+	if (sp.first > 0) {
+		set_fsecs_prepare(NULL);
+		free(bump_warm_blocks);
+		bump_warm_blocks = NULL;
+	}
+
+	munmap(bump_lo, bytes + BUMP_HDR);
+	bump_lo = NULL;
+}
+
+/*
+ * libc_memalign - The libc counterpart of mm_memalign
+ */
+static void *libc_memalign(size_t align, size_t size)
+{
+	void *p;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	return (posix_memalign(&p, align, size) == 0) ? p : NULL;
+}
+
+/*
+ * eval_libc_valid - We run this function to make sure that the
+ *    libc malloc can run to completion on the set of traces.
+ *    We'll be conservative and terminate if any libc malloc call fails.
+ *
+ */
+static int eval_libc_valid(trace_t *trace)
+{
+	int i, j, newsize;
+	char *p, *newp, *oldp;
+
+	reinit_trace(trace);
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+		switch (trace->ops[i].type) {
+
+			case ALLOC: /* malloc */
+				if ((p = malloc(trace->ops[i].size)) == NULL) {
+					malloc_error(trace, i, "libc malloc failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = p;
+				break;
+
+			case MEMALIGN: /* posix_memalign */
+				if ((p = libc_memalign(trace->ops[i].align,
+								trace->ops[i].size)) == NULL) {
+					malloc_error(trace, i, "libc posix_memalign failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = p;
+				break;
+
+			case REALLOC: /* realloc */
+				newsize = trace->ops[i].size;
+				oldp = trace->blocks[trace->ops[i].index];
+				if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
+					malloc_error(trace, i, "libc realloc failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = newp;
+				break;
+
+			case FREE: /* free */
+				if(trace->ops[i].index >= 0) {
+					free(trace->blocks[trace->ops[i].index]);
+				} else {
+					free(0);
+				}
+				break;
+
+			case SIZED_FREE: /* free */
+				free(trace->blocks[trace->ops[i].index]);
+				break;
+
+			case MALLOC_BATCH: /* malloc, one by one */
+				for (j = 0; j < trace->ops[i].count; j++) {
+					if ((p = malloc(trace->ops[i].size)) == NULL) {
+						malloc_error(trace, i, "libc malloc failed");
+						unix_error("System message");
+					}
+					trace->blocks[trace->ops[i].index + j] = p;
+				}
+				break;
+
+			case FREE_BATCH: /* free, one by one */
+				for (j = 0; j < trace->ops[i].count; j++)
+					free(trace->blocks[trace->ops[i].index + j]);
+				break;
+
+			case ARENA_CREATE: /* nothing */
+				break;
+
+			case ARENA_ALLOC: /* malloc */
+				if ((p = malloc(trace->ops[i].size)) == NULL) {
+					malloc_error(trace, i, "libc malloc failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = p;
+				break;
+
+			case ARENA_RESET: /* free, one by one */
+			case ARENA_DESTROY:
+				for (j = trace->ops[i].index; j >= 0; j = trace->arena_next[j])
+					free(trace->blocks[j]);
+				break;
+
+			default:
+				app_error("invalid operation type  in eval_libc_valid");
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * eval_libc_speed - This is the function that is used by fcyc() to
+ *    measure the running time of the libc malloc package on the set
+ *    of traces. It is the same replay as -b libc, so the two agree
+ *    and the null replay's time comes off both.
+ */
+static void eval_libc_speed(void *ptr)
+{
+	backend = &libc_backend;
+	eval_backend_speed(ptr);
+}
+
+/**********************************************************************
+ * The following functions evaluate allocators outside mm.c (-b): the
+ * driver's own libc, or any shared object with malloc, free and
+ * realloc. Each trace runs in a child process, so every backend starts
+ * from a fresh heap and its footprint counts that trace alone.
+ **********************************************************************/
+
+#ifndef OJ /* only the command line adds backends */
+/*
+ * open_backend - Set up be for the allocator spec names: "libc",
+ *     "jemalloc" or "tcmalloc", or the path of a shared object. Returns
+ *     -1, with a warning, if it isn't there.
+ */
+static int open_backend(const char *spec, backend_t *be)
+{
+	static const char *const known[][3] = {
+		{ "jemalloc", "libjemalloc.so.2", "libjemalloc.so" },
+		{ "tcmalloc", "libtcmalloc_minimal.so.4", "libtcmalloc.so.4" },
+	};
+	const char *base;
+	void *handle = NULL;
+	int i, j;
+
+	memset(be, 0, sizeof(*be));
+	base = strrchr(spec, '/') ? strrchr(spec, '/') + 1 : spec;
+	strncpy(be->name, base, sizeof(be->name) - 1);
+	if (strcmp(spec, "libc") == 0) {
+		*be = libc_backend;
+		return 0;
+	}
+
+	/* Its own symbols first (RTLD_DEEPBIND), or it would call ours */
+	for (i = 0; i < (int)(sizeof(known) / sizeof(known[0])); i++)
+		if (strcmp(spec, known[i][0]) == 0)
+			for (j = 1; j < 3 && handle == NULL; j++)
+				handle = dlopen(known[i][j],
+						RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+	if (handle == NULL)
+		handle = dlopen(spec, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+	if (handle == NULL) {
+		fprintf(stderr, "Skipping backend %s: %s\n", spec, dlerror());
+		return -1;
+	}
+	*(void **)&be->malloc = dlsym(handle, "malloc");
+	*(void **)&be->free = dlsym(handle, "free");
+	*(void **)&be->realloc = dlsym(handle, "realloc");
+	*(void **)&be->posix_memalign = dlsym(handle, "posix_memalign");
+	if (be->malloc == NULL || be->free == NULL || be->realloc == NULL) {
+		fprintf(stderr, "Skipping backend %s: no malloc, free or realloc\n",
+				spec);
+		dlclose(handle);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * backend_footprint - The memory the backend has taken from the system.
+ *    The libc backend shares its heap with the driver, so its baseline
+ *    is only what the driver has in use: free space left over from the
+ *    driver counts as the backend's once the trace starts.
+ */
+static size_t backend_footprint(const backend_t *be, int baseline)
+{
+	static int statm = -1;
+	char buf[128];
+	unsigned long size, resident;
+	ssize_t len;
+
+#ifdef HAVE_MALLINFO2
+	if (be->libc) {
+		struct mallinfo2 mi = mallinfo2();
+		return (baseline ? mi.uordblks : mi.arena) + mi.hblkhd;
+	}
+#else
+	(void)be;
+	(void)baseline;
+#endif
+	if (statm < 0 && (statm = open("/proc/self/statm", O_RDONLY)) < 0)
+		unix_error("Could not open /proc/self/statm");
+	if ((len = pread(statm, buf, sizeof(buf) - 1, 0)) <= 0)
+		unix_error("Could not read /proc/self/statm");
+	buf[len] = '\0';
+	if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+		app_error("Bad /proc/self/statm: %s", buf);
+	return resident * (size_t)getpagesize();
+}
+
+/*
+ * backend_memalign - posix_memalign of the backend, or NULL
+ */
+static void *backend_memalign(const backend_t *be, size_t align, size_t size)
+{
+	void *p;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (be->posix_memalign == NULL || be->posix_memalign(&p, align, size))
+		return NULL;
+	return p;
+}
+
+/*
+ * eval_backend_valid - Check the backend be for correctness, as
+ *    eval_mm_valid does mm without the range list: its blocks are not
+ *    in our heap. Overlaps show up as garbled data instead. Also store
+ *    the utilization, from the growth of the backend's footprint.
+ */
+static int eval_backend_valid(trace_t *trace, const backend_t *be,
+		double *util)
+{
+	int i, j, index;
+	size_t size, base, footprint, peak;
+	size_t total_size = 0, max_total_size = 0;
+	char *p;
+
+	reinit_trace(trace);
+#ifdef HAVE_MALLINFO2
+	if (be->libc)
+		malloc_trim(0);
+#endif
+	base = peak = backend_footprint(be, 1);
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
+		size = trace->ops[i].size;
+		switch (trace->ops[i].type) {
+
+			case ALLOC:
+			case ARENA_ALLOC:
+			case MEMALIGN:
+				p = (trace->ops[i].type == MEMALIGN) ?
+					backend_memalign(be, trace->ops[i].align, size) :
+					be->malloc(size);
+				if (p == NULL) {
+					malloc_error(trace, i, "%s malloc failed.", be->name);
+					return 0;
+				}
+				if (!IS_ALIGNED(p) || (trace->ops[i].type == MEMALIGN &&
+							((unsigned long)p & (trace->ops[i].align - 1)))) {
+					malloc_error(trace, i, "Payload address (%p) not aligned",
+							p);
+					return 0;
+				}
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				total_size += size;
+				randomize_block(trace, index);
+				break;
+
+			case REALLOC:
+				check_index(trace, i, index);
+				p = be->realloc(trace->blocks[index], size);
+				if (p == NULL && size != 0) {
+					malloc_error(trace, i, "%s realloc failed.", be->name);
+					return 0;
+				}
+				if (p != NULL && !IS_ALIGNED(p)) {
+					malloc_error(trace, i, "Payload address (%p) not aligned",
+							p);
+					return 0;
+				}
+				trace->blocks[index] = p;
+				total_size += size - trace->block_sizes[index];
+				if (size < trace->block_sizes[index])
+					trace->block_sizes[index] = size;
+				check_index(trace, i, index);
+				trace->block_sizes[index] = size;
+				randomize_block(trace, index);
+				break;
+
+			case FREE:
+			case SIZED_FREE:
+				if (index < 0) {
+					be->free(NULL);
+					break;
+				}
+				check_index(trace, i, index);
+				be->free(trace->blocks[index]);
+				total_size -= trace->block_sizes[index];
+				break;
+
+			case MALLOC_BATCH:
+				for (j = index; j < index + trace->ops[i].count; j++) {
+					if ((p = be->malloc(size)) == NULL) {
+						malloc_error(trace, i, "%s malloc failed.", be->name);
+						return 0;
+					}
+					trace->blocks[j] = p;
+					trace->block_sizes[j] = size;
+					total_size += size;
+					randomize_block(trace, j);
+				}
+				break;
+
+			case FREE_BATCH:
+				for (j = index; j < index + trace->ops[i].count; j++) {
+					check_index(trace, i, j);
+					be->free(trace->blocks[j]);
+					total_size -= trace->block_sizes[j];
+				}
+				break;
+
+			case ARENA_CREATE:
+				break;
+
+			case ARENA_RESET:
+			case ARENA_DESTROY:
+				for (j = index; j >= 0; j = trace->arena_next[j]) {
+					check_index(trace, i, j);
+					be->free(trace->blocks[j]);
+					total_size -= trace->block_sizes[j];
+				}
+				break;
+
+			default:
+				app_error("Nonexistent request type in eval_backend_valid");
+		}
+
+		/* Sample the footprint at every new high-water mark, too */
+		if (total_size > max_total_size || i % FOOTPRINT_EVERY == 0 ||
+				i == trace->num_ops - 1) {
+			footprint = backend_footprint(be, 0);
+			peak = (footprint > peak) ? footprint : peak;
+		}
+		if (total_size > max_total_size)
+			max_total_size = total_size;
+	}
+
+	/* Nothing grew if the trace fit in memory the backend already had */
+	*util = (peak > base) ? (double)max_total_size / (peak - base) : 0;
+	return 1;
+}
+
+/*
+ * backend_other - replay_other for the backend being timed
+ */
+static void backend_other(trace_t *trace, int i)
+{
+	int index = trace->ops[i].index;
+	size_t size = trace->ops[i].size;
+	int j;
+
+	switch (trace->ops[i].type) {
+		case ALLOC:
+		case ARENA_ALLOC:
+			if ((trace->blocks[index] = backend->malloc(size)) == NULL)
+				replay_failed(trace, i);
+			break;
+
+		case MEMALIGN:
+			if ((trace->blocks[index] = backend_memalign(backend,
+							trace->ops[i].align, size)) == NULL)
+				replay_failed(trace, i);
+			break;
+
+		case REALLOC:
+			if ((trace->blocks[index] = backend->realloc(trace->blocks[index],
+							size)) == NULL && size != 0)
+				replay_failed(trace, i);
+			break;
+
+		case FREE:
+			backend->free(index < 0 ? NULL : trace->blocks[index]);
+			break;
+
+		case MALLOC_BATCH:
+			for (j = index; j < index + trace->ops[i].count; j++)
+				if ((trace->blocks[j] = backend->malloc(size)) == NULL)
+					replay_failed(trace, i);
+			break;
+
+		case FREE_BATCH:
+			for (j = index; j < index + trace->ops[i].count; j++)
+				backend->free(trace->blocks[j]);
+			break;
+
+		case ARENA_RESET:
+		case ARENA_DESTROY:
+			for (j = index; j >= 0; j = trace->arena_next[j])
+				backend->free(trace->blocks[j]);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * eval_backend_speed - eval_mm_speed for the backend being timed
+ */
+static void eval_backend_speed(void *ptr)
+{
+	replay_mm(ptr, backend->malloc, backend->free, backend->realloc,
+			backend_other);
+}
+
+/*
+ * eval_backend - Check, measure and time the backend be on the trace,
+ *    in a child process, and store the results in stats
+ */
+static void eval_backend(const backend_t *be, trace_t *trace,
+		stats_t *stats)
+{
+	speed_t sp;
+	int fd[2], status;
+	pid_t pid;
+
+	if (pipe(fd) < 0)
+		unix_error("pipe failed in eval_backend");
+	if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_backend");
+	if (pid == 0) {
+		close(fd[0]);
+		backend = be;
+		stats->valid = eval_backend_valid(trace, be, &stats->util);
+		if (stats->valid) {
+			memset(&sp, 0, sizeof(sp));
+			sp.trace = trace;
+			sp.first = 0;
+			sp.last = trace->num_ops;
+			stats->ovhd = fsecs(eval_null_speed, &sp);
+			replay_failures = 0;
+			stats->secs = less_ovhd(fsecs(eval_backend_speed, &sp),
+					stats->ovhd, &stats->noisy);
+			stats->valid = (replay_failures == 0);
+		}
+		if (write(fd[1], stats, sizeof(*stats)) != sizeof(*stats))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fd[1]);
+	if (read(fd[0], stats, sizeof(*stats)) != sizeof(*stats)) {
+		printf("ERROR [trace %s]: backend %s died\n", trace->filename,
+				be->name);
+		stats->valid = 0;
+		errors++;
+	} else if (!stats->valid) {
+		errors++;  /* the child reported it, but its count is lost */
 	}
+	close(fd[0]);
+	waitpid(pid, &status, 0);
+	stats->samples = NULL;
+	stats->nsamples = 0;
+}
 
-	printf(".");
+/**********************************************************************
+ * The following functions replay a trace once with every request
+ * timed individually, to expose the tail latency that fsecs() hides.
+ **********************************************************************/
 
-	return ((double)max_total_size / (double)mem_heapsize());
+/*
+ * lat_size_class - Map a request size to one of LAT_CLASSES classes
+ */
+static int lat_size_class(size_t size)
+{
+	if (size <= 64)
+		return 0;
+	if (size <= 512)
+		return 1;
+	if (size <= 4096)
+		return 2;
+	if (size <= 32768)
+		return 3;
+	return 4;
 }
 
+/*
+ * lat_record - Record one timed request, less the counter overhead
+ */
+static void lat_record(latency_t *lat, int type, size_t size,
+		unsigned long long t0, unsigned long long t1)
+{
+	unsigned long long cyc = t1 - t0;
+
+	cyc = ((double)cyc > lat_ovhd) ? cyc - (unsigned long long)lat_ovhd : 0;
+	lhist_record(&lat->hist[type][lat_size_class(size)], cyc);
+}
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * eval_mm_latency - Replay the trace once against the mm package,
+ *    timing each request. Frees are classed by the size of the block
+ *    being freed, reallocs by the new size.
  */
-static void eval_mm_speed(void *ptr)
+static void eval_mm_latency(trace_t *trace, latency_t *lat)
 {
-	int i, index, size, newsize;
-	char *p, *newp, *oldp, *block;
-	trace_t *trace = ((speed_t *)ptr)->trace;
+	int i, j, n, index;
+	size_t size, got;
+	char *p;
+	mm_arena_t *arena;
+	unsigned long long t0, t1;
+
 	reinit_trace(trace);
 
 	/* Reset the heap and initialize the mm package */
 	mem_reset_brk();
 	if (mm_init() < 0)
-		app_error("mm_init failed in eval_mm_speed");
+		app_error("mm_init failed in eval_mm_latency");
 
-	/* Interpret each trace request */
-	for (i = 0;  i < trace->num_ops;  i++)
+	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
 		switch (trace->ops[i].type) {
 
 			case ALLOC: /* mm_malloc */
-				index = trace->ops[i].index;
 				size = trace->ops[i].size;
-				if ((p = mm_malloc(size)) == NULL)
-					app_error("mm_malloc error in eval_mm_speed");
+				t0 = read_counter_start();
+				p = mm_malloc(size);
+				t1 = read_counter_end();
+				if (p == NULL)
+					app_error("mm_malloc error in eval_mm_latency");
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				break;
+
+			case MEMALIGN: /* mm_memalign */
+				size = trace->ops[i].size;
+				t0 = read_counter_start();
+				p = mm_memalign(trace->ops[i].align, size);
+				t1 = read_counter_end();
+				if (p == NULL)
+					app_error("mm_memalign error in eval_mm_latency");
 				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
 				break;
 
 			case REALLOC: /* mm_realloc */
-				index = trace->ops[i].index;
-				newsize = trace->ops[i].size;
-				oldp = trace->blocks[index];
-				if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
-					app_error("mm_realloc error in eval_mm_speed");
-				trace->blocks[index] = newp;
+				size = trace->ops[i].size;
+				t0 = read_counter_start();
+				p = mm_realloc(trace->blocks[index], size);
+				t1 = read_counter_end();
+				if (p == NULL && size != 0)
+					app_error("mm_realloc error in eval_mm_latency");
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
 				break;
 
 			case FREE: /* mm_free */
-				index = trace->ops[i].index;
-				if(index < 0) {
-					block = 0;
+				if (index < 0) {
+					size = 0;
+					p = 0;
 				} else {
-					block = trace->blocks[index];
+					size = trace->block_sizes[index];
+					p = trace->blocks[index];
 				}
-				mm_free(block);
+				t0 = read_counter_start();
+				mm_free(p);
+				t1 = read_counter_end();
 				break;
 
-			default:
-				app_error("Nonexistent request type in eval_mm_speed");
-		}
-}
+			case SIZED_FREE: /* mm_free_sized */
+				size = trace->block_sizes[index];
+				p = trace->blocks[index];
+				t0 = read_counter_start();
+				mm_free_sized(p, size);
+				t1 = read_counter_end();
+				break;
 
-/*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
- */
-static int eval_libc_valid(trace_t *trace)
-{
-	int i, newsize;
-	char *p, *newp, *oldp;
+			case MALLOC_BATCH: /* mm_malloc_batch */
+				size = trace->ops[i].size;
+				n = trace->ops[i].count;
+				t0 = read_counter_start();
+				got = mm_malloc_batch(n, size, (void **)&trace->blocks[index]);
+				t1 = read_counter_end();
+				if (got != (size_t)n)
+					app_error("mm_malloc_batch error in eval_mm_latency");
+				for (j = index; j < index + n; j++)
+					trace->block_sizes[j] = size;
+				break;
 
-	reinit_trace(trace);
+			case FREE_BATCH: /* mm_free_batch */
+				size = trace->block_sizes[index];
+				t0 = read_counter_start();
+				mm_free_batch(trace->ops[i].count, (void **)&trace->blocks[index]);
+				t1 = read_counter_end();
+				break;
 
-	for (i = 0;  i < trace->num_ops;  i++) {
-		switch (trace->ops[i].type) {
+			case ARENA_CREATE: /* mm_arena_create */
+				size = 0;
+				t0 = read_counter_start();
+				arena = mm_arena_create();
+				t1 = read_counter_end();
+				if (arena == NULL)
+					app_error("mm_arena_create error in eval_mm_latency");
+				trace->arenas[trace->ops[i].arena] = arena;
+				break;
 
-			case ALLOC: /* malloc */
-				if ((p = malloc(trace->ops[i].size)) == NULL) {
-					malloc_error(trace, i, "libc malloc failed");
-					unix_error("System message");
-				}
-				trace->blocks[trace->ops[i].index] = p;
+			case ARENA_ALLOC: /* mm_arena_alloc */
+				size = trace->ops[i].size;
+				t0 = read_counter_start();
+				p = mm_arena_alloc(trace->arenas[trace->ops[i].arena], size);
+				t1 = read_counter_end();
+				if (p == NULL)
+					app_error("mm_arena_alloc error in eval_mm_latency");
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
 				break;
 
-			case REALLOC: /* realloc */
-				newsize = trace->ops[i].size;
-				oldp = trace->blocks[trace->ops[i].index];
-				if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0) {
-					malloc_error(trace, i, "libc realloc failed");
-					unix_error("System message");
-				}
-				trace->blocks[trace->ops[i].index] = newp;
+			case ARENA_RESET: /* mm_arena_reset */
+				size = (index >= 0) ? trace->block_sizes[index] : 0;
+				t0 = read_counter_start();
+				mm_arena_reset(trace->arenas[trace->ops[i].arena]);
+				t1 = read_counter_end();
 				break;
 
-			case FREE: /* free */
-				if(trace->ops[i].index >= 0) {
-					free(trace->blocks[trace->ops[i].index]);
-				} else {
-					free(0);
-				}
+			case ARENA_DESTROY: /* mm_arena_destroy */
+				size = (index >= 0) ? trace->block_sizes[index] : 0;
+				t0 = read_counter_start();
+				mm_arena_destroy(trace->arenas[trace->ops[i].arena]);
+				t1 = read_counter_end();
 				break;
 
 			default:
-				app_error("invalid operation type  in eval_libc_valid");
+				app_error("Nonexistent request type in eval_mm_latency");
 		}
+		lat_record(lat, trace->ops[i].type, size, t0, t1);
 	}
-
-	return 1;
 }
 
 /*
- * eval_libc_speed - This is the function that is used by fcyc() to
- *    measure the running time of the libc malloc package on the set
- *    of traces.
+ * eval_libc_latency - Same as eval_mm_latency, for the libc package
  */
-static void eval_libc_speed(void *ptr)
+static void eval_libc_latency(trace_t *trace, latency_t *lat)
 {
-	int i;
-	int index, size, newsize;
-	char *p, *newp, *oldp, *block;
-	trace_t *trace = ((speed_t *)ptr)->trace;
+	int i, j, n, index;
+	size_t size;
+	char *p;
+	unsigned long long t0, t1;
 
 	reinit_trace(trace);
 
 	for (i = 0;  i < trace->num_ops;  i++) {
+		index = trace->ops[i].index;
 		switch (trace->ops[i].type) {
+
 			case ALLOC: /* malloc */
-				index = trace->ops[i].index;
 				size = trace->ops[i].size;
-				if ((p = malloc(size)) == NULL)
-					unix_error("malloc failed in eval_libc_speed");
+				t0 = read_counter_start();
+				p = malloc(size);
+				t1 = read_counter_end();
+				if (p == NULL)
+					unix_error("malloc failed in eval_libc_latency");
 				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
 				break;
 
-			case REALLOC: /* realloc */
-				index = trace->ops[i].index;
-				newsize = trace->ops[i].size;
-				oldp = trace->blocks[index];
-				if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
-					unix_error("realloc failed in eval_libc_speed\n");
+			case MEMALIGN: /* posix_memalign */
+				size = trace->ops[i].size;
+				t0 = read_counter_start();
+				p = libc_memalign(trace->ops[i].align, size);
+				t1 = read_counter_end();
+				if (p == NULL)
+					unix_error("posix_memalign failed in eval_libc_latency");
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				break;
 
-				trace->blocks[index] = newp;
+			case REALLOC: /* realloc */
+				size = trace->ops[i].size;
+				t0 = read_counter_start();
+				p = realloc(trace->blocks[index], size);
+				t1 = read_counter_end();
+				if (p == NULL && size != 0)
+					unix_error("realloc failed in eval_libc_latency");
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
 				break;
 
 			case FREE: /* free */
-				index = trace->ops[i].index;
-				if(index >= 0) {
-					block = trace->blocks[index];
-					free(block);
+				if (index < 0) {
+					size = 0;
+					p = 0;
 				} else {
-					free(0);
+					size = trace->block_sizes[index];
+					p = trace->blocks[index];
 				}
+				t0 = read_counter_start();
+				free(p);
+				t1 = read_counter_end();
+				break;
+
+			case SIZED_FREE: /* free */
+				size = trace->block_sizes[index];
+				p = trace->blocks[index];
+				t0 = read_counter_start();
+				free(p);
+				t1 = read_counter_end();
+				break;
+
+			case MALLOC_BATCH: /* malloc, one by one */
+				size = trace->ops[i].size;
+				n = trace->ops[i].count;
+				t0 = read_counter_start();
+				for (j = index; j < index + n; j++)
+					if ((trace->blocks[j] = malloc(size)) == NULL)
+						break;
+				t1 = read_counter_end();
+				if (j < index + n)
+					unix_error("malloc failed in eval_libc_latency");
+				for (j = index; j < index + n; j++)
+					trace->block_sizes[j] = size;
 				break;
+
+			case FREE_BATCH: /* free, one by one */
+				size = trace->block_sizes[index];
+				n = trace->ops[i].count;
+				t0 = read_counter_start();
+				for (j = index; j < index + n; j++)
+					free(trace->blocks[j]);
+				t1 = read_counter_end();
+				break;
+
+			case ARENA_CREATE: /* nothing to time */
+				continue;
+
+			case ARENA_ALLOC: /* malloc */
+				size = trace->ops[i].size;
+				t0 = read_counter_start();
+				p = malloc(size);
+				t1 = read_counter_end();
+				if (p == NULL)
+					unix_error("malloc failed in eval_libc_latency");
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				break;
+
+			case ARENA_RESET: /* free, one by one */
+			case ARENA_DESTROY:
+				size = (index >= 0) ? trace->block_sizes[index] : 0;
+				t0 = read_counter_start();
+				for (j = index; j >= 0; j = trace->arena_next[j])
+					free(trace->blocks[j]);
+				t1 = read_counter_end();
+				break;
+
+			default:
+				app_error("Nonexistent request type in eval_libc_latency");
+		}
+		lat_record(lat, trace->ops[i].type, size, t0, t1);
+	}
+}
+
+/*
+ * printlatency - prints latency percentiles for some malloc package,
+ *    merged over all of the traces that were run
+ */
+static const char *lat_opnames[LAT_OPS] = { "malloc", "free", "realloc",
+	"memalign", "free_sized", "malloc_batch", "free_batch",
+	"arena_create", "arena_alloc", "arena_reset", "arena_destroy" };
+static const char *lat_classnames[LAT_CLASSES] =
+	{ "<=64", "<=512", "<=4K", "<=32K", ">32K" };
+
+static void printlatency(const char *name, latency_t *lat)
+{
+	int op, c;
+	lhist_t *h;
+
+	printf("\nLatency for %s malloc (cycles, less %.0f cycles of timer overhead):\n",
+			name, lat_ovhd);
+	printf("%13s%7s%10s%9s%9s%9s%10s\n",
+			"op", "size", "ops", "p50", "p99", "p99.9", "max");
+	for (op = 0; op < LAT_OPS; op++) {
+		for (c = 0; c < LAT_CLASSES; c++) {
+			h = &lat->hist[op][c];
+			if (h->total == 0)
+				continue;
+			printf("%13s%7s%10llu%9llu%9llu%9llu%10llu\n",
+					lat_opnames[op], lat_classnames[c], h->total,
+					lhist_percentile(h, 0.50),
+					lhist_percentile(h, 0.99),
+					lhist_percentile(h, 0.999),
+					h->max);
 		}
 	}
 }
@@ -1309,20 +3396,23 @@ static void printresults(int n, stats_t *stats)
 	double sumops  = 0;
 	double sumutil = 0;
 	int sumweight = 0;
+	int noisy = 0;
 
 	/* Print the individual results for each trace */
 	printf("  %6s%6s %5s%8s%12s  %s\n",
 			"valid", "util", "ops", "secs", "Kops", "trace");
 	for (i=0; i < n; i++) {
 		if (stats[i].valid) {
-			printf("%2s%4s %5.0f%%%8.0f%10.6f%9.0f %s\n",
+			printf("%2s%4s %5.0f%%%8.0f%10.6f%9.0f%s%s\n",
 					stats[i].weight != 0 ? "*" : "",
 					"yes",
 					stats[i].util*100.0,
 					stats[i].ops,
 					stats[i].secs,
 					(stats[i].ops/1e3)/stats[i].secs,
+					stats[i].noisy ? "~" : " ",
 					stats[i].filename);
+			noisy |= stats[i].noisy;
 			sumweight += stats[i].weight;
 			sumsecs += stats[i].secs * stats[i].weight;
 			sumops += stats[i].ops * stats[i].weight;
@@ -1357,7 +3447,490 @@ static void printresults(int n, stats_t *stats)
 				"-",
 				"-");
 	}
+	if (noisy)
+		printf("~ the driver's own loop took over %.0f%% of the time: "
+				"secs is that floor\n", (1 - OVHD_FLOOR) * 100.0);
+}
+
+/*
+ * printrefs - prints mm next to the reference allocators: the util of
+ *     the perfect packer, and the Kops of the null allocator (just the
+ *     driver) and of the bump allocator (never frees, less the driver).
+ *     Bump's is "-" where it was not clearly above the driver's noise.
+ */
+static void printrefs(int n, stats_t *stats)
+{
+	int i, r;
+	double sumutil = 0, sumoracle = 0;
+	double sumops = 0, sumsecs = 0;
+	double refops = 0, refsecs[NUM_REFS] = { 0 };
+	int refnoisy[NUM_REFS] = { 0 };
+	int sumweight = 0;
+
+	printf("\nReference allocators:\n");
+	printf("  %6s%8s%10s", "util", "oracle", "Kops");
+	for (r = 0; r < NUM_REFS; r++)
+		printf("%10s", refs[r].name);
+	printf("  %s\n", "trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid)
+			continue;
+		printf("  %5.0f%% %6.0f%%%10.0f",
+				stats[i].util * 100.0, stats[i].oracle * 100.0,
+				(stats[i].ops / 1e3) / stats[i].secs);
+		for (r = 0; r < NUM_REFS; r++) {
+			if (stats[i].ref_noisy[r])
+				printf("%10s", "-");
+			else
+				printf("%10.0f", (stats[i].ref_ops / 1e3) / stats[i].ref_secs[r]);
+		}
+		printf("  %s\n", stats[i].filename);
+		sumweight += stats[i].weight;
+		sumutil += stats[i].util * stats[i].weight;
+		sumoracle += stats[i].oracle * stats[i].weight;
+		sumops += stats[i].ops * stats[i].weight;
+		sumsecs += stats[i].secs * stats[i].weight;
+		refops += stats[i].ref_ops * stats[i].weight;
+		for (r = 0; r < NUM_REFS; r++) {
+			refsecs[r] += stats[i].ref_secs[r] * stats[i].weight;
+			refnoisy[r] |= stats[i].weight && stats[i].ref_noisy[r];
+		}
+	}
+	if (sumweight == 0 || sumsecs == 0)
+		return;
+	printf("  %5.0f%% %6.0f%%%10.0f",
+			sumutil / sumweight * 100.0, sumoracle / sumweight * 100.0,
+			(sumops / 1e3) / sumsecs);
+	for (r = 0; r < NUM_REFS; r++) {
+		if (refnoisy[r] || refsecs[r] == 0)
+			printf("%10s", "-");
+		else
+			printf("%10.0f", (refops / 1e3) / refsecs[r]);
+	}
+	printf("\n");
+}
+
+/*
+ * printmatrix - prints the util and Kops of each of m allocators
+ *    (columns: a policy, or a backend) on every trace (rows), then
+ *    the average util and overall Kops
+ */
+static void printmatrix(const char *title, int m, const char **names,
+		int n, stats_t **stats)
+{
+	int i, p, nvalid;
+	double sumops, sumsecs, sumutil;
+
+	printf("\n%s (util, Kops):\n", title);
+	for (p = 0; p < m; p++)
+		printf("%14s", names[p]);
+	printf("  %s\n", "trace");
+	for (i = 0; i < n; i++) {
+		for (p = 0; p < m; p++) {
+			if (stats[p][i].valid)
+				printf("%5.0f%%%8.0f", stats[p][i].util*100.0,
+						(stats[p][i].ops/1e3)/stats[p][i].secs);
+			else
+				printf("%6s%8s", "-", "-");
+		}
+		printf("  %s\n", stats[0][i].filename);
+	}
+
+	/* Unweighted, so that every trace counts */
+	for (p = 0; p < m; p++) {
+		sumops = sumsecs = sumutil = 0;
+		nvalid = 0;
+		for (i = 0; i < n; i++) {
+			if (stats[p][i].valid) {
+				sumops += stats[p][i].ops;
+				sumsecs += stats[p][i].secs;
+				sumutil += stats[p][i].util;
+				nvalid++;
+			}
+		}
+		if (nvalid == n)
+			printf("%5.0f%%%8.0f", sumutil/n*100.0,
+					(sumsecs == 0.0) ? 0 : (sumops/1e3)/sumsecs);
+		else
+			printf("%6s%8s", "-", "-");
+	}
+	printf("  %s\n", "all");
+}
+
+/*
+ * printperf - prints the hardware event counts of each trace, per
+ *    request, followed by the totals over all traces
+ */
+static void printperf(int n, stats_t *stats)
+{
+	int i, e;
+	double sumops = 0;
+	double sum[FPERF_NEVENTS];
+
+	for (e = 0; e < FPERF_NEVENTS; e++)
+		sum[e] = 0;
+
+	printf("\nHardware events per request:\n");
+	for (e = 0; e < FPERF_NEVENTS; e++)
+		printf("%10s", fperf_names[e]);
+	printf("%6s  %s\n", "IPC", "trace");
+
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid)
+			continue;
+		for (e = 0; e < FPERF_NEVENTS; e++) {
+			if (stats[i].perf[e] < 0) {
+				printf("%10s", "-");
+				sum[e] = -1;
+			} else {
+				printf("%10.2f", stats[i].perf[e] / stats[i].ops);
+				if (sum[e] >= 0)
+					sum[e] += stats[i].perf[e];
+			}
+		}
+		if (stats[i].perf[FPERF_CYCLES] > 0 && stats[i].perf[FPERF_INSTRUCTIONS] >= 0)
+			printf("%6.2f", stats[i].perf[FPERF_INSTRUCTIONS] /
+					stats[i].perf[FPERF_CYCLES]);
+		else
+			printf("%6s", "-");
+		printf("  %s\n", stats[i].filename);
+		sumops += stats[i].ops;
+	}
+
+	/* Aggregate over all traces */
+	if (sumops == 0)
+		return;
+	for (e = 0; e < FPERF_NEVENTS; e++) {
+		if (sum[e] < 0)
+			printf("%10s", "-");
+		else
+			printf("%10.2f", sum[e] / sumops);
+	}
+	if (sum[FPERF_CYCLES] > 0 && sum[FPERF_INSTRUCTIONS] >= 0)
+		printf("%6.2f", sum[FPERF_INSTRUCTIONS] / sum[FPERF_CYCLES]);
+	else
+		printf("%6s", "-");
+	printf("  (all traces, %.0f requests)\n", sumops);
+}
+
+/*****************************************************************
+ * The following routines summarize the timing samples kept in
+ * benchmark mode, and compare them with those of another build.
+ ****************************************************************/
+
+/*
+ * printbench - prints the median throughput of each trace with its
+ *    spread (MAD) and a bootstrap confidence interval
+ */
+static void printbench(int n, stats_t *stats)
+{
+	int i;
+	double med, mad, lo, hi;
+
+	printf("\nThroughput over %d samples per trace (%.0f%% CI of the median):\n",
+			bench_samples, BENCH_LEVEL*100);
+	printf("%10s%8s%21s  %s\n", "Kops", "MAD", "CI (Kops)", "trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid || stats[i].nsamples == 0)
+			continue;
+		med = fstats_median(stats[i].samples, stats[i].nsamples);
+		mad = fstats_mad(stats[i].samples, stats[i].nsamples);
+		fstats_bootstrap_ci(stats[i].samples, stats[i].nsamples,
+				BENCH_LEVEL, BENCH_BOOT, &lo, &hi);
+		printf("%10.0f%7.2f%%%10.0f -%9.0f  %s\n",
+				(stats[i].ops/1e3)/med,
+				mad/med*100.0,
+				(stats[i].ops/1e3)/hi,
+				(stats[i].ops/1e3)/lo,
+				stats[i].filename);
+	}
+}
+
+/*
+ * save_samples - Write one line per trace:
+ *    <trace> <valid> <ops> <util> <nsamples> <secs>...
+ */
+static void save_samples(const char *filename, int n, stats_t *stats)
+{
+	FILE *fp;
+	int i, j;
+
+	if ((fp = fopen(filename, "w")) == NULL)
+		unix_error("Could not open %s in save_samples", filename);
+	fprintf(fp, "mdriver-samples 1\n");
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%s %d %.0f %.6f %d", stats[i].filename, stats[i].valid,
+				stats[i].ops, stats[i].util, stats[i].nsamples);
+		for (j = 0; j < stats[i].nsamples; j++)
+			fprintf(fp, " %.9g", stats[i].samples[j]);
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+}
+
+/*
+ * compare_samples - Compare this run with the samples another build
+ *    saved with -S. A trace regresses if its throughput is lower by
+ *    more than BENCH_MIN_DIFF and the Mann-Whitney test rejects equal
+ *    distributions at BENCH_ALPHA, or if its utilization is lower by
+ *    more than BENCH_UTIL_TOL, or if it was valid and now isn't.
+ *    Returns the number of regressions.
+ */
+static int compare_samples(const char *filename, int n, stats_t *stats)
+{
+	FILE *fp;
+	char name[MAXLINE], header[MAXLINE];
+	int i, j, valid, nbase, version, regressions = 0;
+	double ops, util, p, base_med, new_med, change;
+	double *base;
+	const char *verdict;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		unix_error("Could not open %s in compare_samples", filename);
+	if (fscanf(fp, "%1023s %d", header, &version) != 2 ||
+			strcmp(header, "mdriver-samples") != 0 || version != 1)
+		app_error("%s: not a samples file written by -S\n", filename);
+
+	printf("\nComparison with %s:\n", filename);
+	printf("%10s%10s%8s%9s%7s%7s  %-11s %s\n", "base Kops", "new Kops",
+			"change", "p", "b.util", "util", "verdict", "trace");
+
+	while (fscanf(fp, "%1023s %d %lf %lf %d", name, &valid, &ops, &util,
+				&nbase) == 5) {
+		if ((base = malloc((nbase > 0 ? nbase : 1) * sizeof(double))) == NULL)
+			unix_error("malloc failed in compare_samples");
+		for (j = 0; j < nbase; j++)
+			if (fscanf(fp, "%lf", &base[j]) != 1)
+				app_error("%s: truncated samples for %s\n", filename, name);
+
+		for (i = 0; i < n; i++)
+			if (strcmp(stats[i].filename, name) == 0)
+				break;
+
+		/* A build that breaks a trace regresses, however fast it is */
+		if (i < n && valid && !stats[i].valid) {
+			printf("%10.0f%10s%8s%9s%6.0f%%%7s  %-11s %s\n",
+					nbase > 0 ? (ops/1e3)/fstats_median(base, nbase) : 0,
+					"-", "-", "-", util*100.0, "-", "REGRESSION", name);
+			regressions++;
+			free(base);
+			continue;
+		}
+		if (i == n || !valid || !stats[i].valid ||
+				nbase == 0 || stats[i].nsamples == 0) {
+			free(base);
+			continue;
+		}
+
+		base_med = fstats_median(base, nbase);
+		new_med = fstats_median(stats[i].samples, stats[i].nsamples);
+		change = base_med/new_med - 1.0;  /* throughput change */
+		p = fstats_mann_whitney(base, nbase,
+				stats[i].samples, stats[i].nsamples);
+
+		if (change < -BENCH_MIN_DIFF && p < BENCH_ALPHA)
+			verdict = "REGRESSION";
+		else if (stats[i].util < util - BENCH_UTIL_TOL)
+			verdict = "REGRESSION";
+		else if (change > BENCH_MIN_DIFF && p < BENCH_ALPHA)
+			verdict = "faster";
+		else
+			verdict = "same";
+		if (verdict[0] == 'R')
+			regressions++;
+
+		printf("%10.0f%10.0f%+7.1f%%%9.2g%6.0f%%%6.0f%%  %-11s %s\n",
+				(ops/1e3)/base_med, (stats[i].ops/1e3)/new_med,
+				change*100.0, p, util*100.0, stats[i].util*100.0,
+				verdict, name);
+		free(base);
+	}
+	fclose(fp);
+
+	if (regressions)
+		printf("%d trace%s regressed\n", regressions,
+				regressions > 1 ? "s" : "");
+	return regressions;
+}
+
+/*
+ * json_string - Write s as a JSON string
+ */
+static void json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+ * cpu_model - The "model name" of the first CPU in /proc/cpuinfo
+ */
+static void cpu_model(char *buf, size_t len)
+{
+	char line[MAXLINE], *p;
+	FILE *fp;
+
+	snprintf(buf, len, "unknown");
+	if ((fp = fopen("/proc/cpuinfo", "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "model name", 10) == 0 &&
+				(p = strchr(line, ':')) != NULL) {
+			for (p++; *p == ' ' || *p == '\t'; p++)
+				;
+			p[strcspn(p, "\n")] = '\0';
+			snprintf(buf, len, "%s", p);
+			break;
+		}
+	}
+	fclose(fp);
+}
+
+/*
+ * build_id_note - dl_iterate_phdr callback: the GNU build id of the
+ *    driver itself (the first object), as hex into the buffer at data
+ */
+static int build_id_note(struct dl_phdr_info *info,
+		size_t size __attribute__((unused)), void *data)
+{
+	char *buf = data;
+	const ElfW(Nhdr) *note;
+	const unsigned char *desc;
+	const char *p, *end;
+	unsigned i;
+	int ph;
+
+	for (ph = 0; ph < info->dlpi_phnum; ph++) {
+		if (info->dlpi_phdr[ph].p_type != PT_NOTE)
+			continue;
+		p = (const char *)(info->dlpi_addr + info->dlpi_phdr[ph].p_vaddr);
+		end = p + info->dlpi_phdr[ph].p_memsz;
+		while (p + sizeof(*note) <= end) {
+			note = (const ElfW(Nhdr) *)p;
+			desc = (const unsigned char *)p + sizeof(*note) +
+				((note->n_namesz + 3) & ~3u);
+			if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+					memcmp(p + sizeof(*note), "GNU", 4) == 0) {
+				for (i = 0; i < note->n_descsz && i < 32; i++)
+					sprintf(buf + 2*i, "%02x", desc[i]);
+				return 1;
+			}
+			p = (const char *)desc + ((note->n_descsz + 3) & ~3u);
+		}
+	}
+	return 1; /* only the first object is ours */
+}
+
+/*
+ * build_id - The build id the linker gave the driver, which changes
+ *    whenever the mm.c linked into it does, or "none"
+ */
+static void build_id(char *buf, size_t len)
+{
+	char id[65] = "none";
+
+	dl_iterate_phdr(build_id_note, id);
+	snprintf(buf, len, "%s", id);
+}
+
+/*
+ * json_latency - Write the latency percentiles of lat, one entry per
+ *    request type and size class that occurred
+ */
+static void json_latency(FILE *fp, latency_t *lat)
+{
+	int op, c, first = 1;
+	lhist_t *h;
+
+	fprintf(fp, "[");
+	for (op = 0; op < LAT_OPS; op++) {
+		for (c = 0; c < LAT_CLASSES; c++) {
+			h = &lat->hist[op][c];
+			if (h->total == 0)
+				continue;
+			fprintf(fp, "%s\n    {\"op\": \"%s\", \"size\": \"%s\", "
+					"\"ops\": %llu, \"p50\": %llu, \"p99\": %llu, "
+					"\"p99.9\": %llu, \"max\": %llu}",
+					first ? "" : ",", lat_opnames[op], lat_classnames[c],
+					h->total, lhist_percentile(h, 0.50),
+					lhist_percentile(h, 0.99), lhist_percentile(h, 0.999),
+					h->max);
+			first = 0;
+		}
+	}
+	fprintf(fp, "\n  ]");
+}
+
+/*
+ * save_results - Write what printresults and the perf index show, and
+ *    the host and build they come from, to filename as JSON. Keys are
+ *    always in the same order and each trace is on one line, so two
+ *    runs diff line by line.
+ */
+static void save_results(const char *filename, int n, stats_t *stats,
+		double util, double thru, double p1, double p2)
+{
+	char buf[MAXLINE];
+	struct utsname uts;
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(filename, "w")) == NULL)
+		unix_error("Could not open %s in save_results", filename);
+
+	fprintf(fp, "{\n  \"format\": \"mdriver-results 1\",\n");
+	cpu_model(buf, sizeof(buf));
+	fprintf(fp, "  \"host\": {\"cpu\": ");
+	json_string(fp, buf);
+	if (uname(&uts) < 0)
+		snprintf(uts.release, sizeof(uts.release), "unknown");
+	fprintf(fp, ", \"tsc_mhz\": %.1f, \"kernel\": ", mhz(0));
+	json_string(fp, uts.release);
+	build_id(buf, sizeof(buf));
+	fprintf(fp, "},\n  \"build\": {\"id\": \"%s\", \"policy\": \"%s\", "
+			"\"alignment\": %d},\n", buf, mm_policy(), ALIGNMENT);
+
+	fprintf(fp, "  \"traces\": [");
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%s\n    {\"trace\": ", i ? "," : "");
+		json_string(fp, stats[i].filename);
+		fprintf(fp, ", \"weight\": %d, \"valid\": %s, \"ops\": %.0f",
+				stats[i].weight, stats[i].valid ? "true" : "false",
+				stats[i].ops);
+		if (stats[i].valid)
+			fprintf(fp, ", \"util\": %.6f, \"secs\": %.9f, \"kops\": %.0f, "
+					"\"noisy\": %s}",
+					stats[i].util, stats[i].secs,
+					(stats[i].secs == 0) ? 0 :
+					(stats[i].ops/1e3)/stats[i].secs,
+					stats[i].noisy ? "true" : "false");
+		else
+			fprintf(fp, ", \"util\": null, \"secs\": null, \"kops\": null, "
+					"\"noisy\": null}");
+	}
+	fprintf(fp, "\n  ],\n");
+
+	if (run_latency) {
+		fprintf(fp, "  \"latency_cycles\": ");
+		json_latency(fp, mm_latency);
+		fprintf(fp, ",\n");
+	}
 
+	/* The perf index is 0 if any trace failed, as main prints it */
+	fprintf(fp, "  \"perf_index\": {\"util\": %.6f, \"kops\": %.0f, "
+			"\"util_points\": %.6f, \"thru_points\": %.6f, \"total\": %.6f}\n}\n",
+			util, thru/1e3, errors ? 0 : p1*100, errors ? 0 : p2*100,
+			errors ? 0 : (p1 + p2)*100);
+	if (fclose(fp) != 0)
+		unix_error("Could not write %s in save_results", filename);
 }
 
 /*
@@ -1405,7 +3978,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-	fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+	fprintf(stderr, "Usage: mdriver [-hlLPqVdD] [-f <file>] [-p <policy>] [-b <backend>] [-o <file>] [-w <n>] [-B <n>] [-S|-C <file>] [-T <file> [-N <n>]]\n");
 	fprintf(stderr, "Options\n");
 	fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
 	fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1413,9 +3986,23 @@ static void usage(void)
 	fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
 	fprintf(stderr, "\t-h         Print this message.\n");
 	fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+	fprintf(stderr, "\t-L         Report per-operation latency percentiles.\n");
+	fprintf(stderr, "\t-P         Report hardware performance counters.\n");
+	fprintf(stderr, "\t-B <n>     Keep n timing samples per trace and report their spread.\n");
+	fprintf(stderr, "\t-S <file>  Save the timing samples to <file>.\n");
+	fprintf(stderr, "\t-C <file>  Compare with samples saved by -S; exit %d on a regression, 1 on an error.\n",
+			EXIT_REGRESSION);
+	fprintf(stderr, "\t-p <name>  Use allocation policy <name>; \"all\" compares every policy.\n");
+	fprintf(stderr, "\t-b <name>  Compare with libc, jemalloc, tcmalloc or a .so (repeat for more).\n");
+	fprintf(stderr, "\t-w <n>     Time each trace from the heap its first n requests leave.\n");
+	fprintf(stderr, "\t-q         Quick: utilization from the correctness run.\n");
+	fprintf(stderr, "\t-o <file>  Write the results to <file> as JSON.\n");
+	fprintf(stderr, "\t-T <file>  Write heap statistics over time to <file> as CSV.\n");
+	fprintf(stderr, "\t-N <n>     Sample the -T statistics every n requests (default %d).\n",
+			TIMELINE_EVERY);
 	fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
 	fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
 	fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
-	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+	fprintf(stderr, "\t-f <file>  Use <file> as the trace file (repeat for more).\n");
 	fprintf(stderr, "\t-j         Use <stdin> as the trace file.\n");
 }
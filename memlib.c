@@ -2,7 +2,12 @@
  * memlib.c - a module that simulates the memory system.	Needed because it 
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
+ *
+ * Built with MM_PRELOAD (for libmm.so), the "simulated" heap is the real
+ * heap of the process: MAX_OS_HEAP bytes of address space reserved
+ * anywhere the kernel likes, instead of the driver's fixed mapping.
  */
+#define _GNU_SOURCE		/* memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -19,11 +24,27 @@
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static char *mem_peak_brk;	/* highest mem_brk since the last reset */
+
+/* the heap saved by mem_snapshot */
+static int snap_fd = -1;	/* memfd holding the saved bytes */
+static size_t snap_len;		/* whole pages of it in use */
+static size_t snap_size;	/* its size, never shrunk */
+static char *snap_brk;
+static char *snap_peak_brk;
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void){
+#ifdef MM_PRELOAD
+	heap = mmap(NULL, MAX_OS_HEAP, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (heap == MAP_FAILED)
+		heap = NULL;				/* every mem_sbrk will fail */
+	mem_max_addr = heap ? heap + MAX_OS_HEAP : NULL;
+	mem_brk = heap;
+#else
 	int dev_zero = open("/dev/zero", O_RDWR);
 	heap = mmap((void *)0x800000000, /* suggested start*/
 			MAX_HEAP,				/* length */
@@ -33,13 +54,19 @@ void mem_init(void){
 			0);						/* offset (dunno) */
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+#endif
+	mem_peak_brk = mem_brk;
 }
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
+#ifdef MM_PRELOAD
+	munmap(heap, MAX_OS_HEAP);
+#else
 	munmap(heap, MAX_HEAP);
+#endif
 }
 
 /*
@@ -47,25 +74,93 @@ void mem_deinit(void){
  */
 void mem_reset_brk(){
 	mem_brk = heap;
+	mem_peak_brk = heap;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap; the peak size is remembered for
+ *		mem_peak_heapsize.
  */
 void *mem_sbrk(int incr) {
 	char *old_brk = mem_brk;
 
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+	if ((mem_brk + incr) < heap || (mem_brk + incr) > mem_max_addr) {
 		errno = ENOMEM;
+#ifndef MM_PRELOAD	/* running out is not an error for a real malloc */
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+#endif
 		return (void *)-1;
 	}
 	mem_brk += incr;
+	if (mem_brk > mem_peak_brk)
+		mem_peak_brk = mem_brk;
+#ifdef MM_PRELOAD
+	/* hand whole pages given back to the kernel */
+	if (incr < 0) {
+		char *lo = (char *)(((unsigned long)mem_brk + mem_pagesize() - 1) &
+				~(mem_pagesize() - 1));
+		if (lo < old_brk)
+			madvise(lo, old_brk - lo, MADV_DONTNEED);
+	}
+#endif
 	return (void *)old_brk;
 }
 
+/*
+ * mem_snapshot - save the heap, to be brought back by mem_restore.
+ *		The bytes are copied into a memfd; returns -1 if that fails.
+ */
+int mem_snapshot(void) {
+	size_t len = mem_heapsize(), done = 0;
+	ssize_t n;
+
+	if (snap_fd < 0 && (snap_fd = memfd_create("mem_snapshot", 0)) < 0)
+		return -1;
+	snap_len = (len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+	/* the heap may still map pages of an earlier, larger snapshot */
+	if (snap_len > snap_size) {
+		if (ftruncate(snap_fd, snap_len) < 0)
+			return -1;
+		snap_size = snap_len;
+	}
+	while (done < len) {
+		if ((n = pwrite(snap_fd, heap + done, len - done, done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	snap_brk = mem_brk;
+	snap_peak_brk = mem_peak_brk;
+	return 0;
+}
+
+/*
+ * mem_restore - put back the heap saved by the last mem_snapshot.
+ *		The memfd is mapped copy-on-write over the heap, and every page
+ *		is written once here, so that whatever runs next does not take
+ *		the copy faults. Returns -1 if there is no snapshot or the
+ *		mapping fails.
+ */
+int mem_restore(void) {
+	volatile char *p;
+
+	if (snap_fd < 0)
+		return -1;
+	if (snap_len > 0 &&
+			mmap(heap, snap_len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, snap_fd, 0) == MAP_FAILED)
+		return -1;
+	for (p = heap; p < heap + snap_len; p += mem_pagesize())
+		*p = *p;
+	mem_brk = snap_brk;
+	mem_peak_brk = snap_peak_brk;
+	return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -87,6 +182,14 @@ size_t mem_heapsize() {
 	return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest heap size since the last
+ *		reset, which is what a heap that was shrunk still cost
+ */
+size_t mem_peak_heapsize() {
+	return (size_t)(mem_peak_brk - heap);
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
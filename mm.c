@@ -5,12 +5,15 @@
  * is no test data similar to the case I consider in report.
  */
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "memlib.h"
 #include "mm.h"
 
@@ -24,26 +27,35 @@
 #endif
 
 /* do not change the following! */
-#ifdef DRIVER
-/* create aliases for driver tests */
+#if defined(DRIVER) || defined(MM_PRELOAD)
+/* create aliases for driver tests (the preload shim wraps these too) */
 #define malloc mm_malloc
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
 #endif /* def DRIVER */
 
-/* single word (4) or double word (8) alignment */
-#define ALIGNMENT 8
+/* payload alignment comes from config.h: 8 or 16 bytes */
+#if ALIGNMENT != 8 && ALIGNMENT != 16
+#error "mm.c supports an ALIGNMENT of 8 or 16"
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
 #define WSIZE 4            /* header/footer size (bytes) */
 #define BSIZE 8            /* double word size (bytes) */
-#define CHUNKSIZE (1 << 8) /* extend heap size (bytes) */
+#define MIN_BLOCK (2 * BSIZE) /* header, two free-list links and footer */
+#define CHUNKSIZE (1 << 8) /* smallest heap extension (bytes) */
+#define HEAP_START (4 * WSIZE) /* padding, prologue and epilogue (bytes) */
+
+#if HEAP_START % ALIGNMENT != 0
+#error "HEAP_START must keep the first payload aligned"
+#endif
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 #define PACK(size, alloc)                                                      \
   ((size) | (alloc)) /* pack size and alloc bit into a word (why? in report),  \
@@ -56,6 +68,8 @@
 #define GET_SIZE(ptr) (READ(ptr) & ~0x7) /* get size of a block */
 #define GET_ALLOC(ptr) (READ(ptr) & 0x1)
 /* get alloc bit of a block,  0 -> unallocated, 1 -> allocated */
+#define PENDING 0x2 /* allocated block queued for mm_free_batch */
+#define GET_PENDING(ptr) (READ(ptr) & PENDING)
 
 #define HEADER(ptr)                                                            \
   ((char *)(ptr)-WSIZE) /* given block ptr, get header address of a block      \
@@ -90,41 +104,192 @@
        : (WRITE(((char *)(ptr) + WSIZE),                                       \
                 (val - (long)(heap_list))))) /* set next free block ptr */
 
-/* select fit strategy */
-#define FIRST_BEST_FIT
-
-#ifdef FIRST_BEST_FIT
+/*
+ * Allocation policies. A policy is the table of choices the allocator
+ * makes: how the free list is searched, where a freed block goes on
+ * it, how big a remainder has to be to be split off, which end of a
+ * free block a request is placed at, how much the heap grows at a
+ * time, and which freed blocks wait on the quick lists. mm_set_policy picks one by name at run time; the default is
+ * "lifo", or "address" if built with -DADDRESS_ORDER.
+ *
+ * The routines that consult the policy are always inlined and take it
+ * as an argument. The public entry points pass the selected policy and
+ * pay an indirect call per search and list update. mm_malloc_<name>,
+ * mm_free_<name> and mm_realloc_<name> pass one policy's table as a
+ * constant instead, so the compiler folds the table away and calls its
+ * routines directly.
+ */
+typedef struct {
+  const char *name;
+  void *(*find_fit)(size_t block_size); /* fit search */
+  void (*insert)(void *ptr);            /* free list insertion order */
+  void (*remove)(void *ptr);            /* its matching removal */
+  size_t split; /* split off a remainder larger than this (bytes) */
+  size_t chunk; /* extend the heap by at least this (bytes) */
+  size_t tail;  /* place blocks of at least this at the tail (0: never) */
+  size_t quick; /* keep freed blocks of at most this on quick lists (0: never) */
+} policy_t;
+
+#define INLINE static inline __attribute__((always_inline))
+
+/* the first-best fit searches stop after this many blocks have a fit */
 #define MAX_SEARCH_FREE_BLOCK 1
-#endif
+
+/*
+ * The sizeclass policy keeps small and large blocks apart: requests of
+ * TAIL_MIN bytes or more are cut from the tail of a free block, smaller
+ * ones from its head, so the two kinds build up from opposite ends of
+ * free space. It does not split off a remainder of SPLIT_MIN bytes or
+ * less, which few requests fit and would sit on the free list as a
+ * sliver.
+ */
+#define SPLIT_MIN 32  /* largest remainder left inside a block (bytes) */
+#define TAIL_MIN 1024 /* smallest block placed at the tail (bytes) */
+
+/*
+ * Quick lists (the quick policy): a freed block of at most QUICK_MAX
+ * bytes is not coalesced but pushed, still marked allocated, on a LIFO list of
+ * blocks of its exact size, linked through its payload. A malloc of
+ * that size pops it back without touching a boundary tag or the free
+ * list. The lists are consolidated (their blocks really freed and
+ * merged) when a request misses the free list, before the heap is
+ * extended, and when they hold more than QUICK_BUDGET bytes. Blocks
+ * that wait there unmerged cost utilization, so the other policies
+ * free every block at once.
+ */
+#define QUICK_MAX 128                       /* largest quick block (bytes) */
+#define QUICK_BINS (QUICK_MAX / ALIGNMENT + 1) /* bin i: blocks of i*ALIGNMENT */
+#define QUICK_BUDGET (16 * 1024)            /* consolidate above this */
+#define QUICK_NEXT(ptr) (*(char **)(ptr))   /* next block on a quick list */
 
 static char *heap_list;
 static char *free_list = NULL;
+static char *quick_list[QUICK_BINS];
+static size_t quick_bytes = 0; /* bytes held by the quick lists */
+
+/*
+ * Address-ordered free list: a new free block goes right after the
+ * closest free block below it. To find that block without walking the
+ * list, a bitmap has one bit per ALIGNMENT bytes of heap, set where a
+ * free block starts. Two summary levels above it (bit i of a level
+ * says word i of the level below is nonzero) bound the search for the
+ * previous set bit to a few word scans. The maps cover the largest
+ * heap memlib can hand out; pages of them are only touched as the heap
+ * grows into them.
+ */
+#ifdef MM_PRELOAD
+#define MAP_HEAP MAX_OS_HEAP
+#else
+#define MAP_HEAP MAX_HEAP
+#endif
+#define MAP_BITS (MAP_HEAP / ALIGNMENT)
+#define MAP_WORDS0 (MAP_BITS / 64 + 1)
+#define MAP_WORDS1 (MAP_WORDS0 / 64 + 1)
+#define MAP_WORDS2 (MAP_WORDS1 / 64 + 1)
+
+static unsigned long free_map0[MAP_WORDS0];
+static unsigned long free_map1[MAP_WORDS1];
+static unsigned long free_map2[MAP_WORDS2];
+static size_t map_top = 0; /* free_map0 words above this are all zero */
+
+// bit of the free block ptr in free_map0
+static size_t map_bit(void *ptr);
+
+// mark or unmark a free block start in the maps
+static void map_set(size_t bit);
+static void map_clear(size_t bit);
+
+// the free block closest below bit, or NULL
+static char *map_prev(size_t bit);
 
 // extend the heap by creating a new block and a new end
 // block return the start address of the new block after
 // merge
-static void *extend_heap(size_t heap_size);
+INLINE void *extend_heap(const policy_t *P, size_t heap_size);
+
+// extend the heap so that it ends with a free block of at least need
+// bytes, and return that block
+static void *grow_heap(const policy_t *P, size_t need);
+
+// give all but a little of ptr back to the system if it is a large
+// free block at the end of the heap
+INLINE void trim_heap(char *ptr);
 
 // merge the block with its previous and next block if
 // they are free always input a new free block
-static void *merge_block(void *ptr);
+INLINE void *merge_block(const policy_t *P, void *ptr);
 
-// find a free block that fits the size
-static void *find_fitted_block(size_t block_size);
+// find a free block that fits the size: the first fit, the best of
+// the first few fits, or the best fit
+static void *find_first_fit(size_t block_size);
+static void *find_first_best_fit(size_t block_size);
+static void *find_best_fit(size_t block_size);
 
-// set the block's header and footer
-static void set_block(void *ptr, size_t block_size);
+// find a free block that fits the size at an aligned payload address
+static void *find_aligned_block(size_t block_size, size_t alignment);
 
-// remove the block from the free list
-static void remove_free_block(void *ptr);
+// allocate block_size bytes at the first aligned address of a free block
+static void *place_aligned(const policy_t *P, char *ptr, size_t block_size,
+                           size_t alignment);
 
-// insert the block to the free list
-static void insert_free_block(void *ptr);
+// allocate block_size bytes of the free block ptr, at its head or its
+// tail, and return the allocated block
+INLINE void *set_block(const policy_t *P, void *ptr, size_t block_size);
 
-static void *extend_heap(size_t heap_size) {
+// free and merge every block on the quick lists; return the largest
+// free block that came out of it
+static void *consolidate(const policy_t *P);
+
+// remove the block from the free list
+static void remove_lifo(void *ptr);
+static void remove_address(void *ptr);
+
+// insert the block to the free list, at the head or in address order
+static void insert_lifo(void *ptr);
+static void insert_address(void *ptr);
+
+// one table per name in MM_POLICIES
+static const policy_t policy_lifo = {"lifo", find_first_best_fit,
+                                     insert_lifo, remove_lifo, BSIZE,
+                                     CHUNKSIZE, 0, 0};
+static const policy_t policy_address = {"address", find_first_best_fit,
+                                        insert_address, remove_address, BSIZE,
+                                        CHUNKSIZE, 0, 0};
+static const policy_t policy_first = {"first", find_first_fit, insert_lifo,
+                                      remove_lifo, BSIZE, CHUNKSIZE, 0, 0};
+static const policy_t policy_best = {"best", find_best_fit, insert_lifo,
+                                     remove_lifo, BSIZE, CHUNKSIZE, 0, 0};
+static const policy_t policy_addrfirst = {"addrfirst", find_first_fit,
+                                          insert_address, remove_address,
+                                          BSIZE, CHUNKSIZE, 0, 0};
+static const policy_t policy_split64 = {"split64", find_first_best_fit,
+                                        insert_lifo, remove_lifo, 64,
+                                        CHUNKSIZE, 0, 0};
+static const policy_t policy_chunk4k = {"chunk4k", find_first_best_fit,
+                                        insert_lifo, remove_lifo, BSIZE,
+                                        4096, 0, 0};
+static const policy_t policy_sizeclass = {"sizeclass", find_first_best_fit,
+                                          insert_lifo, remove_lifo, SPLIT_MIN,
+                                          CHUNKSIZE, TAIL_MIN, 0};
+static const policy_t policy_quick = {"quick", find_first_best_fit,
+                                      insert_lifo, remove_lifo, BSIZE,
+                                      CHUNKSIZE, 0, QUICK_MAX};
+
+#define POLICY_TABLE(name) &policy_##name,
+static const policy_t *const policies[] = {MM_POLICIES(POLICY_TABLE)};
+
+#ifdef ADDRESS_ORDER
+static const policy_t *policy = &policy_address;
+#else
+static const policy_t *policy = &policy_lifo;
+#endif
+static const policy_t *next_policy = NULL; /* set by mm_set_policy */
+
+INLINE void *extend_heap(const policy_t *P, size_t heap_size) {
   char *new_ptr;
 
-  if ((long)(new_ptr = mem_sbrk(heap_size)) == -1)
+  // mem_sbrk takes an int
+  if (heap_size > INT_MAX || (long)(new_ptr = mem_sbrk(heap_size)) == -1)
     return NULL;
 
   // we don't move the new_ptr forward  because we use the
@@ -134,10 +299,50 @@ static void *extend_heap(size_t heap_size) {
   WRITE(FOOTER(new_ptr), PACK(heap_size, 0));
   WRITE(HEADER(NEXT_BLOCK(new_ptr)), PACK(0, 1));
 
-  return merge_block(new_ptr);
+  return merge_block(P, new_ptr);
 }
 
-static void *merge_block(void *ptr) {
+/*
+ * Heap growth: below EXTEND_HEAP the heap is extended by the policy's
+ * chunk, as placement there is sensitive to how much free space sits
+ * at the tail. A larger heap is extended by a fraction of its size, at
+ * most EXTEND_MAX, so it needs a logarithmic number of extensions, not
+ * one per chunk; a free block at the end of the heap counts towards
+ * the extension. A free tail larger than TRIM_THRESHOLD is given back
+ * down to TRIM_KEEP; the next extension is then a fraction of the
+ * smaller heap. The threshold is high because a heap that shrinks and
+ * regrows loses its old layout.
+ */
+#define EXTEND_HEAP (16 * 1024 * 1024) /* grow geometrically above this */
+#define EXTEND_RATIO 256               /* extend by heap size / EXTEND_RATIO */
+#define EXTEND_MAX (256 * 1024)        /* largest extension (bytes) */
+#define TRIM_THRESHOLD (1024 * 1024)   /* trim a free tail above this (bytes) */
+#define TRIM_KEEP (TRIM_THRESHOLD / 2) /* free tail left after a trim */
+
+static void *grow_heap(const policy_t *P, size_t need) {
+  char *last = PREV_BLOCK((char *)mem_heap_hi() + 1);
+  size_t tail = GET_ALLOC(HEADER(last)) ? 0 : GET_SIZE(HEADER(last));
+  size_t step = MIN(ALIGN(mem_heapsize() / EXTEND_RATIO), EXTEND_MAX);
+
+  if (mem_heapsize() < EXTEND_HEAP)
+    return extend_heap(P, MAX(need, P->chunk));
+  if (tail >= need)
+    return last;
+  return extend_heap(P, MAX(MAX(need, step), P->chunk) - tail);
+}
+
+INLINE void trim_heap(char *ptr) {
+  size_t size = GET_SIZE(HEADER(ptr));
+
+  if (size <= TRIM_THRESHOLD || GET_SIZE(HEADER(NEXT_BLOCK(ptr))) != 0)
+    return;
+  WRITE(HEADER(ptr), PACK(TRIM_KEEP, 0));
+  WRITE(FOOTER(ptr), PACK(TRIM_KEEP, 0));
+  WRITE(HEADER(NEXT_BLOCK(ptr)), PACK(0, 1));
+  mem_sbrk(-(int)(size - TRIM_KEEP));
+}
+
+INLINE void *merge_block(const policy_t *P, void *ptr) {
   size_t pre_alloc = GET_ALLOC(HEADER(PREV_BLOCK(ptr)));
   size_t nxt_alloc = GET_ALLOC(HEADER(NEXT_BLOCK(ptr)));
   size_t block_size = GET_SIZE(HEADER(ptr));
@@ -146,35 +351,43 @@ static void *merge_block(void *ptr) {
     // don't return, still need to insert the block to the
     // free list
   } else if (pre_alloc && !nxt_alloc) {
-    remove_free_block(NEXT_BLOCK(ptr));
+    P->remove(NEXT_BLOCK(ptr));
     block_size += GET_SIZE(HEADER(NEXT_BLOCK(ptr)));
     WRITE(HEADER(ptr), PACK(block_size, 0));
     WRITE(FOOTER(ptr), PACK(block_size, 0));
   } else if (!pre_alloc && nxt_alloc) {
-    remove_free_block(PREV_BLOCK(ptr));
+    P->remove(PREV_BLOCK(ptr));
     block_size += GET_SIZE(HEADER(PREV_BLOCK(ptr)));
     WRITE(FOOTER(ptr), PACK(block_size, 0));
     WRITE(HEADER(PREV_BLOCK(ptr)), PACK(block_size, 0));
     ptr = PREV_BLOCK(ptr);
   } else {
-    remove_free_block(PREV_BLOCK(ptr));
-    remove_free_block(NEXT_BLOCK(ptr));
+    P->remove(PREV_BLOCK(ptr));
+    P->remove(NEXT_BLOCK(ptr));
     block_size +=
         GET_SIZE(HEADER(PREV_BLOCK(ptr))) + GET_SIZE(HEADER(NEXT_BLOCK(ptr)));
     WRITE(HEADER(PREV_BLOCK(ptr)), PACK(block_size, 0));
     WRITE(FOOTER(NEXT_BLOCK(ptr)), PACK(block_size, 0));
     ptr = PREV_BLOCK(ptr);
   }
-  insert_free_block(ptr);
+  P->insert(ptr);
   return ptr;
 }
 
-static void *find_fitted_block(size_t block_size) {
-  void *ptr;
+static void *find_first_fit(size_t block_size) {
+  char *ptr;
 
-#ifdef FIRST_BEST_FIT
+  for (ptr = free_list; ptr != NULL; ptr = (char *)GET_NEXT_FREE_BLOCK(ptr))
+    if (GET_SIZE(HEADER(ptr)) >= block_size)
+      return ptr;
+  return NULL;
+}
+
+static void *find_first_best_fit(size_t block_size) {
+  void *ptr;
   char *best_ptr = NULL;
   size_t min_size = 0, free_block_cnt = 0;
+
   for (ptr = free_list; ptr != NULL;
        ptr = GET_NEXT_FREE_BLOCK(ptr), free_block_cnt++) {
     if (GET_SIZE(HEADER(ptr)) >= block_size) {
@@ -187,32 +400,205 @@ static void *find_fitted_block(size_t block_size) {
       break;
   }
   return best_ptr;
-#endif
+}
 
-  return NULL;
+static void *find_best_fit(size_t block_size) {
+  char *ptr, *best_ptr = NULL;
+  size_t size, min_size = 0;
+
+  for (ptr = free_list; ptr != NULL; ptr = (char *)GET_NEXT_FREE_BLOCK(ptr)) {
+    size = GET_SIZE(HEADER(ptr));
+    if (size >= block_size && (min_size == 0 || size < min_size)) {
+      best_ptr = ptr;
+      min_size = size;
+      if (size == block_size)
+        break; // nothing fits better
+    }
+  }
+  return best_ptr;
+}
+
+// the first aligned payload address in the block at ptr that leaves
+// either no lead or a lead big enough to be a free block of its own
+static char *aligned_start(char *ptr, size_t alignment) {
+  char *aligned =
+      (char *)(((unsigned long)ptr + alignment - 1) & ~(alignment - 1));
+
+  while (aligned != ptr && aligned - ptr < MIN_BLOCK)
+    aligned += alignment;
+  return aligned;
+}
+
+static void *find_aligned_block(size_t block_size, size_t alignment) {
+  char *ptr, *best_ptr = NULL;
+  size_t size, lead, min_size = 0, free_block_cnt = 0;
+
+  // same search as find_first_best_fit, but the lead counts against
+  // the block
+  for (ptr = free_list; ptr != NULL;
+       ptr = (char *)GET_NEXT_FREE_BLOCK(ptr), free_block_cnt++) {
+    size = GET_SIZE(HEADER(ptr));
+    lead = aligned_start(ptr, alignment) - ptr;
+    if (size >= lead + block_size && (min_size == 0 || size < min_size)) {
+      best_ptr = ptr;
+      min_size = size;
+    }
+    if (free_block_cnt > MAX_SEARCH_FREE_BLOCK && best_ptr != NULL)
+      break;
+  }
+  return best_ptr;
 }
 
-static void set_block(void *ptr, size_t block_size) {
+static void *place_aligned(const policy_t *P, char *ptr, size_t block_size,
+                           size_t alignment) {
+  char *aligned = aligned_start(ptr, alignment);
+  size_t total = GET_SIZE(HEADER(ptr));
+  size_t lead = aligned - ptr;
+
+  P->remove(ptr);
+
+  // the lead stays free: the block before a free block is never free,
+  // so there is nothing to merge it with
+  if (lead > 0) {
+    WRITE(HEADER(ptr), PACK(lead, 0));
+    WRITE(FOOTER(ptr), PACK(lead, 0));
+    P->insert(ptr);
+    total -= lead;
+  }
+
+  if (total - block_size > P->split) {
+    WRITE(HEADER(aligned), PACK(block_size, 1));
+    WRITE(FOOTER(aligned), PACK(block_size, 1));
+    ptr = NEXT_BLOCK(aligned);
+    WRITE(HEADER(ptr), PACK(total - block_size, 0));
+    WRITE(FOOTER(ptr), PACK(total - block_size, 0));
+    merge_block(P, ptr);
+  } else {
+    WRITE(HEADER(aligned), PACK(total, 1));
+    WRITE(FOOTER(aligned), PACK(total, 1));
+  }
+  return aligned;
+}
+
+INLINE void *set_block(const policy_t *P, void *ptr, size_t block_size) {
   size_t current_block_size = GET_SIZE(HEADER(ptr));
-  remove_free_block(ptr);
 
-  // if the block size is larger than the required size,
-  // split the block
-  if (current_block_size - block_size > BSIZE) {
-    WRITE(HEADER(ptr), PACK(block_size, 1));
-    WRITE(FOOTER(ptr), PACK(block_size, 1));
-    ptr = NEXT_BLOCK(ptr);
+  // a large block taken from the tail leaves the head where it was,
+  // free and on the free list, so only its size changes
+  if (P->tail != 0 && block_size >= P->tail &&
+      current_block_size - block_size > P->split) {
     WRITE(HEADER(ptr), PACK(current_block_size - block_size, 0));
     WRITE(FOOTER(ptr), PACK(current_block_size - block_size, 0));
-    merge_block(ptr);
+    ptr = NEXT_BLOCK(ptr);
+    WRITE(HEADER(ptr), PACK(block_size, 1));
+    WRITE(FOOTER(ptr), PACK(block_size, 1));
+    return ptr;
+  }
+
+  P->remove(ptr);
+
+  // if the block size is larger than the required size by more than
+  // the policy's split threshold, split the block
+  if (current_block_size - block_size > P->split) {
+    char *rest = (char *)ptr + block_size;
+
+    WRITE(HEADER(ptr), PACK(block_size, 1));
+    WRITE(FOOTER(ptr), PACK(block_size, 1));
+    WRITE(HEADER(rest), PACK(current_block_size - block_size, 0));
+    WRITE(FOOTER(rest), PACK(current_block_size - block_size, 0));
+    merge_block(P, rest);
   } else {
     // assign alloc bit to 1
     WRITE(HEADER(ptr), PACK(current_block_size, 1));
     WRITE(FOOTER(ptr), PACK(current_block_size, 1));
   }
+  return ptr;
 }
 
-static void remove_free_block(void *ptr) {
+static void *consolidate(const policy_t *P) {
+  char *ptr, *next, *last, *best = NULL;
+  size_t i, size;
+
+  for (i = 0; i < QUICK_BINS; i++) {
+    for (ptr = quick_list[i]; ptr != NULL; ptr = next) {
+      next = QUICK_NEXT(ptr); // merge_block reuses the link word
+      size = GET_SIZE(HEADER(ptr));
+      WRITE(HEADER(ptr), PACK(size, 0));
+      WRITE(FOOTER(ptr), PACK(size, 0));
+      ptr = merge_block(P, ptr);
+      // if a later merge swallows best, the merged block is larger
+      // and replaces it, so best always starts a free block
+      if (best == NULL || GET_SIZE(HEADER(ptr)) > GET_SIZE(HEADER(best)))
+        best = ptr;
+    }
+    quick_list[i] = NULL;
+  }
+  quick_bytes = 0;
+
+  // trim only once every merge is done: a trimmed tail may be best, but
+  // it still starts a free block, just a smaller one
+  last = PREV_BLOCK((char *)mem_heap_hi() + 1);
+  if (!GET_ALLOC(HEADER(last)))
+    trim_heap(last);
+  return best;
+}
+
+static size_t map_bit(void *ptr) {
+  return ((char *)ptr - (char *)mem_heap_lo()) / ALIGNMENT;
+}
+
+static void map_set(size_t bit) {
+  size_t w0 = bit / 64, w1 = w0 / 64;
+
+  if (free_map0[w0] == 0) {
+    if (free_map1[w1] == 0)
+      free_map2[w1 / 64] |= 1UL << (w1 % 64);
+    free_map1[w1] |= 1UL << (w0 % 64);
+  }
+  free_map0[w0] |= 1UL << (bit % 64);
+  if (w0 >= map_top)
+    map_top = w0 + 1;
+}
+
+static void map_clear(size_t bit) {
+  size_t w0 = bit / 64, w1 = w0 / 64;
+
+  if ((free_map0[w0] &= ~(1UL << (bit % 64))) == 0 &&
+      (free_map1[w1] &= ~(1UL << (w0 % 64))) == 0)
+    free_map2[w1 / 64] &= ~(1UL << (w1 % 64));
+}
+
+// the highest set bit of word below position pos, or -1
+static long below(unsigned long word, size_t pos) {
+  word &= (1UL << pos) - 1;
+  return word ? 63 - __builtin_clzl(word) : -1;
+}
+
+static char *map_prev(size_t bit) {
+  size_t w0 = bit / 64, w1 = w0 / 64, w2 = w1 / 64;
+  long b;
+
+  // look left on each level, climbing only when a level runs out
+  if ((b = below(free_map0[w0], bit % 64)) >= 0)
+    return (char *)mem_heap_lo() + (w0 * 64 + b) * ALIGNMENT;
+  if ((b = below(free_map1[w1], w0 % 64)) >= 0) {
+    w0 = w1 * 64 + b;
+  } else {
+    if ((b = below(free_map2[w2], w1 % 64)) < 0) {
+      do {
+        if (w2 == 0)
+          return NULL;
+      } while (free_map2[--w2] == 0);
+      b = 63 - __builtin_clzl(free_map2[w2]);
+    }
+    w1 = w2 * 64 + b;
+    w0 = w1 * 64 + 63 - __builtin_clzl(free_map1[w1]);
+  }
+  b = 63 - __builtin_clzl(free_map0[w0]);
+  return (char *)mem_heap_lo() + (w0 * 64 + b) * ALIGNMENT;
+}
+
+static void remove_lifo(void *ptr) {
   if (ptr == NULL || GET_ALLOC(HEADER(ptr)) == 1)
     return;
 
@@ -232,7 +618,14 @@ static void remove_free_block(void *ptr) {
   }
 }
 
-static void insert_free_block(void *ptr) {
+static void remove_address(void *ptr) {
+  if (ptr == NULL || GET_ALLOC(HEADER(ptr)) == 1)
+    return;
+  map_clear(map_bit(ptr));
+  remove_lifo(ptr);
+}
+
+static void insert_lifo(void *ptr) {
   if (ptr == NULL || GET_ALLOC(HEADER(ptr)) == 1) {
     return;
   }
@@ -250,11 +643,62 @@ static void insert_free_block(void *ptr) {
   free_list = ptr;
 }
 
+static void insert_address(void *ptr) {
+  if (ptr == NULL || GET_ALLOC(HEADER(ptr)) == 1) {
+    return;
+  }
+
+  char *prev = map_prev(map_bit(ptr));
+  void *next;
+
+  map_set(map_bit(ptr));
+  if (prev == NULL) {
+    // lowest free block: it goes at the head, as in LIFO order
+    insert_lifo(ptr);
+    return;
+  }
+  // link in after the closest free block below
+  next = GET_NEXT_FREE_BLOCK(prev);
+  SET_PREV_FREE_BLOCK(ptr, (long)prev);
+  SET_NEXT_FREE_BLOCK(ptr, (long)next);
+  SET_NEXT_FREE_BLOCK(prev, (long)ptr);
+  if (next != NULL)
+    SET_PREV_FREE_BLOCK(next, (long)ptr);
+}
+
+/*
+ * mm_set_policy - Select the allocation policy called name for the
+ * next mm_init. Returns -1 if there is no such policy.
+ */
+int mm_set_policy(const char *name) {
+  size_t i;
+
+  for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    if (strcmp(policies[i]->name, name) == 0) {
+      next_policy = policies[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * mm_policy - The name of the policy the next mm_init will use.
+ */
+const char *mm_policy(void) {
+  return (next_policy != NULL ? next_policy : policy)->name;
+}
+
 /*
  * mm_init - Called when a new trace starts.
  */
 int mm_init(void) {
-  if ((heap_list = mem_sbrk(4 * WSIZE)) == (void *)-1)
+  if (next_policy != NULL)
+    policy = next_policy;
+  // block sizes are multiples of ALIGNMENT, so every payload is aligned
+  // if the first one is: it starts right after the HEAP_START bytes
+  // below, which must therefore be a multiple of ALIGNMENT too
+  if ((heap_list = mem_sbrk(HEAP_START)) == (void *)-1)
     return -1;
   // init heap
   WRITE(heap_list, 0);
@@ -263,20 +707,86 @@ int mm_init(void) {
   WRITE(heap_list + (3 * WSIZE), PACK(0, 1));
   heap_list += BSIZE;
   free_list = NULL;
+  memset(quick_list, 0, sizeof(quick_list));
+  quick_bytes = 0;
+  // only the words a previous heap used can be dirty
+  memset(free_map0, 0, map_top * sizeof(unsigned long));
+  memset(free_map1, 0, (map_top / 64 + 1) * sizeof(unsigned long));
+  memset(free_map2, 0, (map_top / 4096 + 1) * sizeof(unsigned long));
+  map_top = 0;
 
   // extend heap
-  if (extend_heap(CHUNKSIZE) == NULL)
+  if (extend_heap(policy, policy->chunk) == NULL)
     return -1;
   return 0;
 }
 
 /*
- * malloc - Allocate a block by strategy in find_fit().
+ * Snapshots: the globals that describe the heap, saved next to the heap
+ * itself (see mem_snapshot). Only the first map_top words of the maps
+ * can be nonzero, so only those are copied.
  */
-void *malloc(size_t size) {
+static struct {
+  const policy_t *policy;
+  char *heap_list;
+  char *free_list;
+  char *quick_list[QUICK_BINS];
+  size_t quick_bytes;
+  size_t map_top;
+} snap;
+static unsigned long snap_map0[MAP_WORDS0];
+static unsigned long snap_map1[MAP_WORDS1];
+static unsigned long snap_map2[MAP_WORDS2];
+
+/*
+ * mm_snapshot - Save the heap and the allocator's state, for mm_restore
+ * to go back to. Returns -1 if the heap could not be saved.
+ */
+int mm_snapshot(void) {
+  if (mem_snapshot() < 0)
+    return -1;
+  snap.policy = policy;
+  snap.heap_list = heap_list;
+  snap.free_list = free_list;
+  memcpy(snap.quick_list, quick_list, sizeof(quick_list));
+  snap.quick_bytes = quick_bytes;
+  snap.map_top = map_top;
+  memcpy(snap_map0, free_map0, map_top * sizeof(unsigned long));
+  memcpy(snap_map1, free_map1, (map_top / 64 + 1) * sizeof(unsigned long));
+  memcpy(snap_map2, free_map2, (map_top / 4096 + 1) * sizeof(unsigned long));
+  return 0;
+}
+
+/*
+ * mm_restore - Go back to the heap saved by the last mm_snapshot, as if
+ * nothing had happened since. Blocks allocated since are gone, and the
+ * ones that were live then are live again. Returns -1 on failure.
+ */
+int mm_restore(void) {
+  if (mem_restore() < 0)
+    return -1;
+  policy = snap.policy;
+  heap_list = snap.heap_list;
+  free_list = snap.free_list;
+  memcpy(quick_list, snap.quick_list, sizeof(quick_list));
+  quick_bytes = snap.quick_bytes;
+  memset(free_map0, 0, map_top * sizeof(unsigned long));
+  memset(free_map1, 0, (map_top / 64 + 1) * sizeof(unsigned long));
+  memset(free_map2, 0, (map_top / 4096 + 1) * sizeof(unsigned long));
+  map_top = snap.map_top;
+  memcpy(free_map0, snap_map0, map_top * sizeof(unsigned long));
+  memcpy(free_map1, snap_map1, (map_top / 64 + 1) * sizeof(unsigned long));
+  memcpy(free_map2, snap_map2, (map_top / 4096 + 1) * sizeof(unsigned long));
+  return 0;
+}
+
+/*
+ * do_malloc - Allocate a block from its quick list if it has one (only
+ * the quick policy does), else by the policy's fit search.
+ */
+INLINE void *do_malloc(const policy_t *P, size_t size) {
   // block_size includes header and footer
   size_t block_size;
-  size_t extend_size;
   char *ptr;
 
   if (size == 0) {
@@ -285,60 +795,124 @@ void *malloc(size_t size) {
 
   block_size = ALIGN(size + BSIZE);
 
-  if ((ptr = find_fitted_block(block_size)) != NULL) {
-    set_block(ptr, block_size);
+  if (block_size <= P->quick &&
+      (ptr = quick_list[block_size / ALIGNMENT]) != NULL) {
+    quick_list[block_size / ALIGNMENT] = QUICK_NEXT(ptr);
+    quick_bytes -= block_size;
     return ptr;
   }
 
+  if ((ptr = P->find_fit(block_size)) == NULL && quick_bytes > 0) {
+    // nothing else on the free list fits: only a merged block can
+    ptr = consolidate(P);
+    if (GET_SIZE(HEADER(ptr)) < block_size)
+      ptr = NULL;
+  }
+  if (ptr != NULL)
+    return set_block(P, ptr, block_size);
+
   // if there is no fitted block, allocate more memory and
   // place the block
-  extend_size = MAX(block_size, CHUNKSIZE);
-  if ((ptr = extend_heap(extend_size)) == NULL) {
+  if ((ptr = grow_heap(P, block_size)) == NULL) {
     return NULL;
   }
-  set_block(ptr, block_size);
-  return ptr;
+  return set_block(P, ptr, block_size);
 }
 
 /*
- * free - Just return the block and try to merge with pre
- * or next block.
+ * do_free - Put a small block on its quick list, if the policy keeps
+ * them; return any other block and try to merge with pre or next block.
  */
-void free(void *ptr) {
+INLINE void do_free(const policy_t *P, void *ptr) {
   if (ptr == NULL)
     return;
   size_t size = GET_SIZE(HEADER(ptr));
 
+  if (size <= P->quick) {
+    QUICK_NEXT(ptr) = quick_list[size / ALIGNMENT];
+    quick_list[size / ALIGNMENT] = ptr;
+    if ((quick_bytes += size) > QUICK_BUDGET)
+      consolidate(P);
+    return;
+  }
+
   WRITE(HEADER(ptr), PACK(size, 0));
   WRITE(FOOTER(ptr), PACK(size, 0));
-  merge_block(ptr);
+  trim_heap(merge_block(P, ptr));
 }
 
 /*
- * realloc - Change the size of the block by mallocing a
+ * do_realloc - Change the size of the block by mallocing a
  * new block, copying its data, and freeing the old block.
  */
-void *realloc(void *oldptr, size_t size) {
+INLINE void *do_realloc(const policy_t *P, void *oldptr, size_t size) {
   if (oldptr == NULL) {
-    return malloc(size);
+    return do_malloc(P, size);
   }
   if (size == 0) {
-    free(oldptr);
+    do_free(P, oldptr);
     return NULL;
   }
 
   void *newptr;
   size_t copySize;
-  newptr = malloc(size);
+  if ((newptr = do_malloc(P, size)) == NULL)
+    return NULL;
   size = GET_SIZE(HEADER(oldptr));
   copySize = GET_SIZE(HEADER(newptr));
   if (size < copySize)
     copySize = size;
   memcpy(newptr, oldptr, copySize - BSIZE);
-  free(oldptr);
+  do_free(P, oldptr);
   return newptr;
 }
 
+/*
+ * mm_malloc_<name>, mm_free_<name>, mm_realloc_<name> - The above under
+ * one policy, compiled in. The heap must have been initialized under it.
+ */
+#define POLICY_ENTRIES(name)                                                   \
+  void *mm_malloc_##name(size_t size) {                                        \
+    return do_malloc(&policy_##name, size);                                    \
+  }                                                                            \
+  void mm_free_##name(void *ptr) { do_free(&policy_##name, ptr); }             \
+  void *mm_realloc_##name(void *oldptr, size_t size) {                         \
+    return do_realloc(&policy_##name, oldptr, size);                           \
+  }
+MM_POLICIES(POLICY_ENTRIES)
+
+/*
+ * malloc, free, realloc - The same under the selected policy: one
+ * compare per policy picks its entry point, rather than an indirect
+ * call for every search and list update.
+ */
+#define POLICY_MALLOC(name)                                                    \
+  if (policy == &policy_##name)                                                \
+    return mm_malloc_##name(size);
+#define POLICY_FREE(name)                                                      \
+  if (policy == &policy_##name) {                                              \
+    mm_free_##name(ptr);                                                       \
+    return;                                                                    \
+  }
+#define POLICY_REALLOC(name)                                                   \
+  if (policy == &policy_##name)                                                \
+    return mm_realloc_##name(oldptr, size);
+
+void *malloc(size_t size) {
+  MM_POLICIES(POLICY_MALLOC)
+  return do_malloc(policy, size);
+}
+
+void free(void *ptr) {
+  MM_POLICIES(POLICY_FREE)
+  do_free(policy, ptr);
+}
+
+void *realloc(void *oldptr, size_t size) {
+  MM_POLICIES(POLICY_REALLOC)
+  return do_realloc(policy, oldptr, size);
+}
+
 /*
  * calloc - Allocate the block and set it to zero.
  */
@@ -352,19 +926,384 @@ void *calloc(size_t nmemb, size_t size) {
   return newptr;
 }
 
+/*
+ * mm_free_sized - Free a block whose requested size the caller knows.
+ * A block can be larger than its request (an unsplit remainder stays
+ * in it), and the header has to be rewritten anyway, so the size is
+ * only checked against the header.
+ */
+void mm_free_sized(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return;
+  assert(GET_SIZE(HEADER(ptr)) >= ALIGN(size + BSIZE));
+  free(ptr);
+}
+
+/*
+ * carve_batch - Allocate k blocks of block_size bytes back to back at
+ * the start of the free block ptr, which must be big enough.
+ */
+static void carve_batch(char *ptr, size_t k, size_t block_size, void **ptrs) {
+  size_t total, i;
+
+  ptr = set_block(policy, ptr, k * block_size);
+
+  // the last block keeps whatever set_block did not split off
+  total = GET_SIZE(HEADER(ptr));
+  for (i = 0; i < k; i++) {
+    if (i == k - 1)
+      block_size = total;
+    WRITE(HEADER(ptr), PACK(block_size, 1));
+    WRITE(FOOTER(ptr), PACK(block_size, 1));
+    ptrs[i] = ptr;
+    total -= block_size;
+    ptr = NEXT_BLOCK(ptr);
+  }
+}
+
+/*
+ * carve_free_list - One pass over the free list for mm_malloc_batch,
+ * carving as many of the n blocks as fit out of each free block.
+ * Returns how many it placed.
+ */
+static size_t carve_free_list(size_t n, size_t block_size, void **ptrs) {
+  size_t i = 0, k;
+  char *ptr, *next;
+
+  for (ptr = free_list; ptr != NULL && i < n; ptr = next) {
+    next = (char *)GET_NEXT_FREE_BLOCK(ptr);
+    if ((k = GET_SIZE(HEADER(ptr)) / block_size) == 0)
+      continue;
+    if (k > n - i)
+      k = n - i;
+    carve_batch(ptr, k, block_size, ptrs + i);
+    i += k;
+  }
+  return i;
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes into ptrs[]. They
+ * come off their quick list first; then one pass over the free list
+ * carves as many blocks as fit out of each free block, so a batch
+ * costs one search and one split per free block used rather than per
+ * object; the heap is extended once for whatever is left. Returns the
+ * number of blocks allocated, n unless memory ran out.
+ */
+size_t mm_malloc_batch(size_t n, size_t size, void **ptrs) {
+  size_t block_size, bin, i, k;
+  char *ptr;
+
+  if (n == 0 || size == 0)
+    return 0;
+  block_size = ALIGN(size + BSIZE);
+
+  i = 0;
+  if (block_size <= policy->quick) {
+    bin = block_size / ALIGNMENT;
+    for (; i < n && quick_list[bin] != NULL; i++) {
+      ptrs[i] = quick_list[bin];
+      quick_list[bin] = QUICK_NEXT(quick_list[bin]);
+      quick_bytes -= block_size;
+    }
+  }
+
+  i += carve_free_list(n - i, block_size, ptrs + i);
+  if (i < n && quick_bytes > 0) {
+    consolidate(policy);
+    i += carve_free_list(n - i, block_size, ptrs + i);
+  }
+
+  // extend in pieces that fit in a block header
+  while (i < n) {
+    k = MIN(n - i, (1UL << 30) / block_size);
+    if (k == 0 || (ptr = grow_heap(policy, k * block_size)) == NULL)
+      break;
+    carve_batch(ptr, k, block_size, ptrs + i);
+    i += k;
+  }
+  return i;
+}
+
+/*
+ * mm_free_batch - Free the n blocks in ptrs[] (NULLs are skipped).
+ * All blocks are marked PENDING first; then each run of neighbouring
+ * pending blocks becomes one free block with a single merge and a
+ * single free-list insertion, however many blocks it holds.
+ */
+void mm_free_batch(size_t n, void **ptrs) {
+  char *ptr, *start;
+  size_t i, size;
+
+  for (i = 0; i < n; i++) {
+    if ((ptr = ptrs[i]) == NULL)
+      continue;
+    WRITE(HEADER(ptr), READ(HEADER(ptr)) | PENDING);
+    WRITE(FOOTER(ptr), READ(FOOTER(ptr)) | PENDING);
+  }
+
+  for (i = 0; i < n; i++) {
+    if ((ptr = ptrs[i]) == NULL || !GET_PENDING(HEADER(ptr)))
+      continue; // already part of an earlier run
+
+    start = ptr;
+    while (GET_PENDING(HEADER(PREV_BLOCK(start))))
+      start = PREV_BLOCK(start);
+
+    size = 0;
+    for (ptr = start; GET_PENDING(HEADER(ptr)); ptr = NEXT_BLOCK(ptr)) {
+      size += GET_SIZE(HEADER(ptr));
+      WRITE(HEADER(ptr), READ(HEADER(ptr)) & ~PENDING);
+    }
+    WRITE(HEADER(start), PACK(size, 0));
+    WRITE(FOOTER(start), PACK(size, 0));
+    trim_heap(merge_block(policy, start));
+  }
+}
+
+/*
+ * mm_memalign - Allocate a block whose payload is aligned to alignment,
+ * a power of two. The slack in front of the aligned address is split
+ * off as a free block rather than wasted. Neither the alignment nor the
+ * size can be more than the whole heap.
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+  size_t block_size;
+  char *ptr;
+
+  if (alignment <= ALIGNMENT)
+    return malloc(size);
+  if (size == 0 || size > MAX_HEAP || alignment > MAX_HEAP)
+    return NULL;
+
+  block_size = ALIGN(size + BSIZE);
+
+  if ((ptr = find_aligned_block(block_size, alignment)) == NULL &&
+      quick_bytes > 0) {
+    consolidate(policy);
+    ptr = find_aligned_block(block_size, alignment);
+  }
+  if (ptr == NULL) {
+    // room for the payload, the worst-case lead and a free lead block
+    if ((ptr = grow_heap(policy, block_size + alignment + MIN_BLOCK)) == NULL)
+      return NULL;
+  }
+  return place_aligned(policy, ptr, block_size, alignment);
+}
+
+/*
+ * mm_posix_memalign - posix_memalign(3) on top of mm_memalign.
+ */
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  if ((ptr = mm_memalign(alignment, size)) == NULL && size != 0)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+/*
+ * mm_aligned_alloc - C11 aligned_alloc on top of mm_memalign.
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    return NULL;
+  return mm_memalign(alignment, size);
+}
+
+/*
+ * mm_usable_size - The payload bytes of an allocated block, which may
+ * be more than were asked for.
+ */
+size_t mm_usable_size(void *ptr) {
+  if (ptr == NULL)
+    return 0;
+  return GET_SIZE(HEADER(ptr)) - BSIZE;
+}
+
+/*
+ * Arenas: objects that die together (say, everything allocated while
+ * serving one request) are bump-allocated from chunks taken from the
+ * heap with malloc, and freed by handing the chunks back. Releasing an
+ * arena costs one free per chunk, whatever the number of objects.
+ *
+ * Every chunk starts with an arena_chunk_t header, which keeps the
+ * payload behind it aligned. Requests above ARENA_BIG get a chunk of
+ * their own, linked behind the chunk being bumped so its tail is not
+ * thrown away. Chunks are kept small: each live scope holds one
+ * half-used chunk, and that slack is what arenas cost in utilization.
+ */
+#define ARENA_CHUNK 2048            /* bytes per ordinary chunk */
+#define ARENA_BIG (ARENA_CHUNK / 8) /* larger requests get their own chunk */
+
+typedef struct arena_chunk {
+  struct arena_chunk *next; /* older chunk */
+  size_t size;              /* bytes, including this header */
+} arena_chunk_t;
+
+struct mm_arena {
+  arena_chunk_t *chunks; /* newest first; the head is the bump chunk */
+  char *cur;             /* next free byte of the bump chunk */
+  char *end;             /* end of the bump chunk */
+};
+
+/*
+ * arena_chunk - Get a chunk of size bytes from the heap and link it in,
+ * at the head if it becomes the bump chunk, else right behind it.
+ */
+static arena_chunk_t *arena_chunk(mm_arena_t *arena, size_t size, int bump) {
+  arena_chunk_t *chunk;
+
+  if ((chunk = malloc(size)) == NULL)
+    return NULL;
+  chunk->size = size;
+  if (bump || arena->chunks == NULL) {
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  } else {
+    chunk->next = arena->chunks->next;
+    arena->chunks->next = chunk;
+  }
+  if (bump) {
+    arena->cur = (char *)(chunk + 1);
+    arena->end = (char *)chunk + size;
+  }
+  return chunk;
+}
+
+/*
+ * mm_arena_create - Make an empty arena; its first chunk is taken on
+ * the first allocation.
+ */
+mm_arena_t *mm_arena_create(void) {
+  mm_arena_t *arena;
+
+  if ((arena = malloc(sizeof(mm_arena_t))) == NULL)
+    return NULL;
+  arena->chunks = NULL;
+  arena->cur = arena->end = NULL;
+  return arena;
+}
+
+/*
+ * mm_arena_alloc - Allocate size bytes from the arena. The object lives
+ * until the arena is reset or destroyed; it cannot be freed alone.
+ */
+void *mm_arena_alloc(mm_arena_t *arena, size_t size) {
+  arena_chunk_t *chunk;
+  char *ptr;
+
+  size = ALIGN(MAX(size, 1));
+  if (size > (size_t)(arena->end - arena->cur)) {
+    if (size > ARENA_BIG) {
+      if ((chunk = arena_chunk(arena, sizeof(arena_chunk_t) + size, 0)) ==
+          NULL)
+        return NULL;
+      return chunk + 1;
+    }
+    if (arena_chunk(arena, ARENA_CHUNK, 1) == NULL)
+      return NULL;
+  }
+  ptr = arena->cur;
+  arena->cur += size;
+  return ptr;
+}
+
+/*
+ * mm_arena_reset - Free every object in the arena at once, returning
+ * all its chunks to the heap. The arena can be used again.
+ */
+void mm_arena_reset(mm_arena_t *arena) {
+  arena_chunk_t *chunk, *next;
+
+  for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  arena->chunks = NULL;
+  arena->cur = arena->end = NULL;
+}
+
+/*
+ * mm_arena_destroy - Free the arena and everything allocated from it.
+ */
+void mm_arena_destroy(mm_arena_t *arena) {
+  if (arena == NULL)
+    return;
+  mm_arena_reset(arena);
+  free(arena);
+}
+
+/*
+ * mm_heap_stats - Describe the heap in *stats, walking every block.
+ * Blocks on the quick lists are allocated as far as the heap is
+ * concerned but free to the program, so they are counted on their own.
+ */
+void mm_heap_stats(mm_heap_stats_t *stats) {
+  char *ptr;
+  size_t size, bin;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->heap_bytes = mem_heapsize();
+  stats->overhead_bytes = HEAP_START;
+
+  for (bin = 0; bin < QUICK_BINS; bin++) {
+    for (ptr = quick_list[bin]; ptr != NULL; ptr = QUICK_NEXT(ptr)) {
+      stats->quick_blocks++;
+      stats->quick_bytes += bin * ALIGNMENT;
+    }
+  }
+
+  for (ptr = NEXT_BLOCK(heap_list); (size = GET_SIZE(HEADER(ptr))) != 0;
+       ptr = NEXT_BLOCK(ptr)) {
+    stats->overhead_bytes += BSIZE;
+    if (GET_ALLOC(HEADER(ptr))) {
+      stats->alloc_blocks++;
+      stats->alloc_bytes += size;
+      continue;
+    }
+    // bin i holds sizes below MIN_BLOCK << (i + 1)
+    bin = 63 - __builtin_clzl(size / MIN_BLOCK);
+    bin = MIN(bin, MM_STATS_BINS - 1);
+    stats->bin_blocks[bin]++;
+    stats->bin_bytes[bin] += size;
+    stats->free_blocks++;
+    stats->free_bytes += size;
+    stats->largest_free = MAX(stats->largest_free, size);
+  }
+  stats->alloc_blocks -= stats->quick_blocks;
+  stats->alloc_bytes -= stats->quick_bytes;
+  if (stats->free_bytes > 0)
+    stats->external_frag =
+        1.0 - (double)stats->largest_free / stats->free_bytes;
+}
+
 /*
  * mm_checkheap - Check the heap.
  * The constant of the heap is as follows.
  * 1. The prologue block is BSIZE(8 byte) and allocated(prevent merge).
  * 2. The epilogue block is 0 byte and allocated(prevent merge).
- * 3. The block size is multiple of BSIZE(8 byte).
+ * 3. The block size and payload address are multiples of ALIGNMENT
+ *    (except for the prologue).
  * 4. The pointer heap_list is 8 byte after mem_heap_lo().
+ * 5. Every free block is on the free list exactly once, and the free
+ *    list holds nothing else.
+ * The check is linear: one walk over the heap marks each free block
+ * in check_map, and the walk over the free list then clears the mark
+ * of every block it meets, so a block it does not find marked is not
+ * a free block of the heap, or is on the list twice.
  */
+static unsigned long check_map[MAP_WORDS0];
+
 void mm_checkheap(int verbose) {
   /*Get gcc to be quiet. */
   verbose = verbose;
 
-  char *ptr;
+  char *ptr, *blk;
+  size_t bit, free_cnt = 0, list_cnt = 0;
 
   // check epilogue and prologue blocks
   if (GET_SIZE(HEADER(heap_list)) != BSIZE ||
@@ -372,26 +1311,25 @@ void mm_checkheap(int verbose) {
       GET_SIZE(FOOTER(heap_list)) != BSIZE || GET_ALLOC(FOOTER(heap_list)) != 1)
     printf("Prologue block error\n");
 
-  ptr = heap_list;
-  while (GET_SIZE(HEADER(ptr)) != 0) {
-    ptr = NEXT_BLOCK(ptr);
-  }
-  if (GET_SIZE(HEADER(ptr)) != 0 || GET_ALLOC(HEADER(ptr)) != 1)
-    printf("Epilogue block error\n");
-
   // check the boundary of heap
   if (mem_heap_lo() + BSIZE != heap_list) {
     printf("mem_heap_lo: %p, heap_head: %p\n", mem_heap_lo(), heap_list);
     printf("Heap boundary error\n");
   }
-  if (mem_heap_hi() + 1 != (void *)ptr) {
-    printf("mem_heap_hi: %p, heap_end: %p\n", mem_heap_hi(), ptr);
-    printf("Heap boundary error\n");
-  }
 
-  // check the header and footer of each block
+  // check the header and footer of each block, and mark the free ones
   ptr = heap_list;
   while (GET_SIZE(HEADER(ptr)) != 0) {
+    if ((char *)FOOTER(ptr) > (char *)mem_heap_hi()) {
+      printf("Block at %p runs past the end of the heap\n", ptr);
+      // the rest can't be walked: clear the marks made so far
+      for (blk = heap_list; blk != ptr; blk = NEXT_BLOCK(blk)) {
+        bit = map_bit(blk);
+        check_map[bit / 64] &= ~(1UL << (bit % 64));
+      }
+      return;
+    }
+
     // check the consistency of prev and next pointers
     if (PREV_BLOCK(NEXT_BLOCK(ptr)) != ptr) {
       printf("Prev and next pointers error at %p\n", ptr);
@@ -403,52 +1341,94 @@ void mm_checkheap(int verbose) {
     } else if (GET_ALLOC(HEADER(ptr)) != GET_ALLOC(FOOTER(ptr)))
       printf("Header and footer alloc error\n");
 
-    // address alignment
-    if ((unsigned long long)ptr % BSIZE != 0)
-      printf("Block alignment error\n");
+    // address and size alignment
+    if (ptr != heap_list && ((unsigned long long)ptr % ALIGNMENT != 0 ||
+                             GET_SIZE(HEADER(ptr)) % ALIGNMENT != 0))
+      printf("Block alignment error at %p\n", ptr);
 
     // check the continuous of heap
-    if (ptr + GET_SIZE(HEADER(ptr)) != NEXT_BLOCK(ptr))
-      printf("Block continuous error 1\n");
     if (ptr != heap_list) {
       if (FOOTER(PREV_BLOCK(ptr)) != ptr - BSIZE)
         printf("Block continuous error 2\n");
     }
 
+    if (GET_ALLOC(HEADER(ptr)) == 0) {
+      // check merge
+      if (GET_ALLOC(HEADER(NEXT_BLOCK(ptr))) == 0)
+        printf("Merge error at block %p\n", ptr);
+      bit = map_bit(ptr);
+      check_map[bit / 64] |= 1UL << (bit % 64);
+      free_cnt++;
+    }
+
     ptr = NEXT_BLOCK(ptr);
   }
+  if (GET_SIZE(HEADER(ptr)) != 0 || GET_ALLOC(HEADER(ptr)) != 1)
+    printf("Epilogue block error\n");
+  if (mem_heap_hi() + 1 != (void *)ptr) {
+    printf("mem_heap_hi: %p, heap_end: %p\n", mem_heap_hi(), ptr);
+    printf("Heap boundary error\n");
+  }
 
-  // check merge
-  int cnt = 0;
-  ptr = heap_list;
-  while (GET_SIZE(HEADER(ptr)) != 0) {
-    if (GET_ALLOC(HEADER(ptr)) == 0 && GET_ALLOC(HEADER(NEXT_BLOCK(ptr))) == 0)
-      printf("Merge error at block %p\n", ptr);
-    ptr = NEXT_BLOCK(ptr);
-    cnt++;
+  // check the quick lists: allocated blocks of the bin's size
+  size_t bin, quick_total = 0;
+  for (bin = 0; bin < QUICK_BINS; bin++) {
+    for (ptr = quick_list[bin]; ptr != NULL; ptr = QUICK_NEXT(ptr)) {
+      if (GET_ALLOC(HEADER(ptr)) != 1 ||
+          GET_SIZE(HEADER(ptr)) != bin * ALIGNMENT)
+        printf("Quick list %lu error at %p\n", (unsigned long)bin, ptr);
+      quick_total += GET_SIZE(HEADER(ptr));
+    }
   }
+  if (quick_total != quick_bytes)
+    printf("Quick list size error\n");
 
-  // check the free list
+  // check the free list, unmarking each block on it
   ptr = free_list;
   while (ptr != NULL) {
-    if (!((char *)mem_heap_lo() < ptr && ptr < (char *)mem_heap_hi()))
+    if (!((char *)mem_heap_lo() < ptr && ptr < (char *)mem_heap_hi())) {
       printf("Free list boundary error\n");
+      break;
+    }
 
     if (GET_ALLOC(HEADER(ptr)) != 0)
       printf("Allocated block in the free list at %p\n", ptr);
 
+    bit = map_bit(ptr);
+    if ((check_map[bit / 64] & (1UL << (bit % 64))) == 0) {
+      printf("Block %p in the free list is not a free block of the heap, "
+             "or is listed twice\n",
+             ptr);
+      break;
+    }
+    check_map[bit / 64] &= ~(1UL << (bit % 64));
+    list_cnt++;
+
     if (GET_PREV_FREE_BLOCK(ptr) != NULL &&
         (char *)GET_NEXT_FREE_BLOCK(GET_PREV_FREE_BLOCK(ptr)) != ptr)
       printf("Prev and next pointer error at %p\n", ptr);
 
-    void *tmp = heap_list;
-    while (GET_SIZE(HEADER(ptr)) != 0) {
-      if (tmp == ptr)
-        break;
-      tmp = NEXT_BLOCK(tmp);
+    if (policy->insert == insert_address) {
+      if (GET_NEXT_FREE_BLOCK(ptr) != NULL &&
+          (char *)GET_NEXT_FREE_BLOCK(ptr) <= ptr)
+        printf("Free list out of address order at %p\n", ptr);
+      if (map_prev(map_bit(ptr) + 1) != ptr)
+        printf("Free block %p missing from the map\n", ptr);
     }
-    if (GET_SIZE(HEADER(tmp)) == 0)
-      printf("Block in free list is not in the heap\n");
+
     ptr = (char *)GET_NEXT_FREE_BLOCK(ptr);
   }
+
+  // any block still marked is free but was not reached from the list;
+  // clear the marks for the next check
+  if (list_cnt != free_cnt) {
+    printf("%lu free blocks in the heap, %lu in the free list\n",
+           (unsigned long)free_cnt, (unsigned long)list_cnt);
+    for (ptr = heap_list; GET_SIZE(HEADER(ptr)) != 0; ptr = NEXT_BLOCK(ptr)) {
+      bit = map_bit(ptr);
+      if (check_map[bit / 64] & (1UL << (bit % 64)))
+        printf("Free block %p is not in the free list\n", ptr);
+      check_map[bit / 64] &= ~(1UL << (bit % 64));
+    }
+  }
 }
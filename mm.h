@@ -1,14 +1,16 @@
 #include <stdio.h>
 
-#ifdef DRIVER
+#if defined(DRIVER) || defined(MM_PRELOAD)
 
-/* declare functions for driver tests */
+/* declare functions for driver tests and for the LD_PRELOAD shim */
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
 
-#else
+#endif
+
+#ifndef DRIVER
 
 /* declare functions for interpositioning */
 extern void *malloc (size_t size);
@@ -20,6 +22,77 @@ extern void *calloc (size_t nmemb, size_t size);
 
 extern int mm_init(void);
 
+/* Save the heap, and go back to it later, to rerun from that point */
+extern int mm_snapshot(void);
+extern int mm_restore(void);
+
+/*
+ * Allocation policies, one name each (see mm.c). mm_set_policy selects
+ * one for the next mm_init, or returns -1 for an unknown name; mm_policy
+ * names the one it will use. Every policy also has entry points with
+ * the policy compiled in, mm_malloc_<name> and so on, which may only be
+ * used on a heap that mm_init set up under that policy.
+ */
+#define MM_POLICIES(X)                                                  \
+	X(lifo) X(address) X(first) X(best) X(addrfirst) X(split64)     \
+	X(chunk4k) X(sizeclass) X(quick)
+
+#define MM_POLICY_ENTRIES(name)                                         \
+	extern void *mm_malloc_##name(size_t size);                         \
+	extern void mm_free_##name(void *ptr);                              \
+	extern void *mm_realloc_##name(void *ptr, size_t size);
+MM_POLICIES(MM_POLICY_ENTRIES)
+
+extern int mm_set_policy(const char *name);
+extern const char *mm_policy(void);
+
+/* Allocate size bytes aligned to alignment, a power of two */
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+
+/* Free a block of a known request size */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/* Allocate n blocks of size bytes into ptrs[]; returns how many */
+extern size_t mm_malloc_batch(size_t n, size_t size, void **ptrs);
+
+/* Free the n blocks in ptrs[] */
+extern void mm_free_batch(size_t n, void **ptrs);
+
+/* Arenas: bump allocation, freed all at once by reset or destroy */
+typedef struct mm_arena mm_arena_t;
+extern mm_arena_t *mm_arena_create(void);
+extern void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+extern void mm_arena_reset(mm_arena_t *arena);
+extern void mm_arena_destroy(mm_arena_t *arena);
+
+/* Number of payload bytes actually available in an allocated block */
+extern size_t mm_usable_size(void *ptr);
+
+/*
+ * Heap statistics. Free blocks are counted in size classes: class i
+ * holds blocks smaller than 32 << i bytes, and the last class the rest.
+ * External fragmentation is 1 - largest_free / free_bytes, 0 when all
+ * free space is in one block.
+ */
+#define MM_STATS_BINS 16
+typedef struct {
+	size_t heap_bytes;     /* size of the heap */
+	size_t overhead_bytes; /* headers, footers, prologue and epilogue */
+	size_t alloc_blocks;   /* allocated blocks, headers included */
+	size_t alloc_bytes;
+	size_t quick_blocks;   /* freed blocks waiting on the quick lists */
+	size_t quick_bytes;
+	size_t free_blocks;    /* blocks on the free list */
+	size_t free_bytes;
+	size_t largest_free;
+	double external_frag;
+	size_t bin_blocks[MM_STATS_BINS]; /* free blocks per size class */
+	size_t bin_bytes[MM_STATS_BINS];
+} mm_heap_stats_t;
+extern void mm_heap_stats(mm_heap_stats_t *stats);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
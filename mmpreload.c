@@ -0,0 +1,258 @@
+/*
+ * mmpreload.c - LD_PRELOAD front end for the mm.c allocator (libmm.so)
+ *
+ * Interposes the libc allocation functions on any dynamically linked
+ * program:
+ *
+ *     LD_PRELOAD=./libmm.so ./some_program
+ *
+ * mm.c itself is single threaded and knows nothing about processes,
+ * so this file supplies what a real malloc needs around it:
+ *   - lazy initialization of the heap on the first call,
+ *   - one global lock around every call into mm.c,
+ *   - fork safety: the lock is taken across fork() so the child never
+ *     inherits a heap that another thread was half way through
+ *     changing,
+ *   - the rest of the glibc allocation API, built on mm_malloc and
+ *     mm_memalign.
+ *
+ * MM_POLICY names the allocation policy of mm.c to use (see mm.h);
+ * unknown names leave the default in place.
+ *
+ * Built with -DMM_RECORD (libmmrec.so) it also logs every request
+ * through mmrecord.c, to be turned into a .rep trace by rec2rep.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+#ifdef MM_RECORD
+#include "mmrecord.h"
+#define RECORD(op, ptr, old, size) rec_event(op, ptr, old, size)
+#else
+#define RECORD(op, ptr, old, size) do {} while (0)
+#endif
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* Larger requests would overflow the 32-bit block headers */
+#define MAX_REQUEST (1UL << 30)
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mm_ready = 0;     /* heap initialized? */
+static int mm_failed = 0;    /* heap could not be initialized */
+
+/*
+ * lock - Take the allocator lock, setting up the heap on first use.
+ *     Returns 0 if the heap is unusable.
+ */
+static int lock(void) {
+  const char *policy;
+
+  pthread_mutex_lock(&mm_lock);
+  if (!mm_ready && !mm_failed) {
+    if ((policy = getenv("MM_POLICY")) != NULL)
+      mm_set_policy(policy);
+    mem_init();
+    if (mm_init() < 0)
+      mm_failed = 1;
+    else
+      mm_ready = 1;
+  }
+  return mm_ready;
+}
+
+static void unlock(void) { pthread_mutex_unlock(&mm_lock); }
+
+/* fork handlers: hold the lock across fork, start the child unlocked */
+static void atfork_prepare(void) { pthread_mutex_lock(&mm_lock); }
+static void atfork_parent(void) { pthread_mutex_unlock(&mm_lock); }
+static void atfork_child(void) {
+#ifdef MM_RECORD
+  rec_child();
+#endif
+  pthread_mutex_init(&mm_lock, NULL);
+}
+
+__attribute__((constructor)) static void mmpreload_init(void) {
+  pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+#ifdef MM_RECORD
+  rec_start();
+#endif
+}
+
+#ifdef MM_RECORD
+__attribute__((destructor)) static void mmpreload_fini(void) {
+  // the writer may free memory as it exits, so it must not be
+  // joined with the lock held
+  pthread_mutex_lock(&mm_lock);
+  rec_disable();
+  pthread_mutex_unlock(&mm_lock);
+  rec_finish();
+}
+#endif
+
+/* aligned_locked - mm_memalign with the usual checks, lock held */
+static void *aligned_locked(size_t alignment, size_t size) {
+  void *ptr = NULL;
+
+  if (size > MAX_REQUEST || alignment > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (lock())
+    ptr = mm_memalign(alignment, size ? size : 1);
+  if (ptr != NULL)
+    RECORD(REC_MEMALIGN, ptr, (void *)alignment, size);
+  unlock();
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+EXPORT void *malloc(size_t size) {
+  void *ptr = NULL;
+
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // malloc(0) returns a unique pointer, as glibc's does
+  if (lock())
+    ptr = mm_malloc(size ? size : 1);
+  if (ptr != NULL)
+    RECORD(REC_ALLOC, ptr, NULL, size);
+  unlock();
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+EXPORT void free(void *ptr) {
+  if (ptr == NULL)
+    return;
+  lock();
+  mm_free(ptr);
+  RECORD(REC_FREE, ptr, NULL, 0);
+  unlock();
+}
+
+// C23 sized free
+EXPORT void free_sized(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return;
+  lock();
+  mm_free_sized(ptr, size);
+  RECORD(REC_FREE, ptr, NULL, 0);
+  unlock();
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+  void *newptr = NULL;
+
+  if (ptr == NULL)
+    return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (lock())
+    newptr = mm_realloc(ptr, size);
+  if (newptr != NULL)
+    RECORD(REC_REALLOC, newptr, ptr, size);
+  unlock();
+  if (newptr == NULL)
+    errno = ENOMEM;
+  return newptr;
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+  void *ptr = NULL;
+  size_t bytes = nmemb * size;
+
+  if (size != 0 && nmemb > MAX_REQUEST / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // call mm_malloc, not malloc: gcc turns malloc+memset into calloc
+  if (lock())
+    ptr = mm_malloc(bytes ? bytes : 1);
+  if (ptr != NULL)
+    RECORD(REC_ALLOC, ptr, NULL, bytes);
+  unlock();
+  if (ptr == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // blocks are recycled, so they must be cleared even if sbrk'ed fresh
+  memset(ptr, 0, bytes);
+  return ptr;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+  if (size != 0 && nmemb > MAX_REQUEST / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, nmemb * size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+  int saved = errno;
+
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  if ((ptr = aligned_locked(alignment, size)) == NULL) {
+    errno = saved;
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned_locked(alignment, size);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+  return aligned_locked((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aligned_locked(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+  size_t size;
+
+  if (ptr == NULL)
+    return 0;
+  lock();
+  size = mm_usable_size(ptr);
+  unlock();
+  return size;
+}
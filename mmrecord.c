@@ -0,0 +1,233 @@
+/*
+ * mmrecord.c - allocation trace recorder (built into libmmrec.so)
+ *
+ *     LD_PRELOAD=./libmmrec.so MM_RECORD_FILE=app.bin ./some_program
+ *     ./rec2rep -o app.rep app.bin
+ *
+ * Every thread appends fixed-size events to its own ring buffer; a
+ * background writer thread drains all the rings into the output file
+ * with plain write() calls. A ring has one producer (its thread) and
+ * one consumer (the writer), so it needs no lock: the producer only
+ * moves tail, the writer only moves head. Recording a request is a
+ * handful of stores into memory the thread already owns.
+ *
+ * The rings are mmap'ed, and neither the writer nor this file ever
+ * calls malloc, so recording cannot recurse into the allocator.
+ *
+ * Events carry raw pointers; rec2rep turns them into the dense block
+ * ids a .rep trace uses. A ring that is full makes its thread wait
+ * for the writer. Events are only dropped if there is no writer to
+ * wait for (before rec_start, or if the file cannot be written), and
+ * the gap then shows up in the sequence numbers.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmrecord.h"
+
+#define RING_EVENTS (1 << 14)          /* events per thread, power of 2 */
+#define WRITER_NAP_NS 1000000          /* writer poll interval when idle */
+
+typedef struct ring {
+  uint64_t head __attribute__((aligned(64)));   /* moved by the writer */
+  uint64_t tail __attribute__((aligned(64)));   /* moved by the owner */
+  int in_use;                  /* owned by a live thread? */
+  struct ring *next;           /* all rings ever made, newest first */
+  rec_event_t buf[RING_EVENTS];
+} ring_t;
+
+static ring_t *rings = NULL;
+static __thread ring_t *my_ring __attribute__((tls_model("initial-exec")));
+
+/* Protected by the allocator lock (only touched by rec_event and friends) */
+static int recording = 1;
+static uint64_t next_seq = 0;
+static uint64_t dropped = 0;
+
+static int out_fd = -1;
+static int write_failed = 0;
+static int writer_running = 0;
+static int stopping = 0;
+static pthread_t writer;
+static pthread_key_t ring_key;
+
+/* warn - Complain on stderr without going through stdio's buffers */
+static void warn(const char *msg) {
+  ssize_t unused;
+
+  unused = write(STDERR_FILENO, "mmrecord: ", 10);
+  unused = write(STDERR_FILENO, msg, strlen(msg));
+  unused = write(STDERR_FILENO, "\n", 1);
+  (void)unused;
+}
+
+static int write_all(const void *buf, size_t len) {
+  const char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(out_fd, p, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* release_ring - Thread exit: leave the ring for the next new thread */
+static void release_ring(void *arg) {
+  ring_t *r = arg;
+
+  my_ring = NULL;
+  __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* get_ring - This thread's ring: reuse a dead thread's, or map a new one */
+static ring_t *get_ring(void) {
+  ring_t *r;
+  int free_ring;
+
+  if (my_ring != NULL)
+    return my_ring;
+
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+    free_ring = 0;
+    if (__atomic_compare_exchange_n(&r->in_use, &free_ring, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+  if (r == NULL) {
+    r = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED)
+      return NULL;
+    r->in_use = 1;
+    // producers are serialized by the allocator lock; only the writer
+    // walks the list concurrently
+    r->next = rings;
+    __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+  }
+  my_ring = r;
+  if (writer_running)
+    pthread_setspecific(ring_key, r);
+  return r;
+}
+
+void rec_event(uint32_t op, void *ptr, void *old, size_t size) {
+  ring_t *r;
+  rec_event_t *e;
+  uint64_t tail, seq;
+
+  if (!recording)
+    return;
+  seq = next_seq++;
+  if ((r = get_ring()) == NULL) {
+    dropped++;
+    return;
+  }
+
+  tail = r->tail;
+  while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_EVENTS) {
+    if (!writer_running) {
+      dropped++;
+      return;
+    }
+    sched_yield();
+  }
+  e = &r->buf[tail & (RING_EVENTS - 1)];
+  e->seq = seq;
+  e->ptr = (uintptr_t)ptr;
+  e->old = (uintptr_t)old;
+  e->size = (uint32_t)size;
+  e->op = op;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * drain - Write out everything the rings hold. Returns the number of
+ *     events taken. Events that cannot be written are discarded so
+ *     producers never wait on a dead file.
+ */
+static size_t drain(void) {
+  ring_t *r;
+  uint64_t head, tail, start, len;
+  size_t taken = 0;
+
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      start = head & (RING_EVENTS - 1);
+      len = tail - head;
+      if (len > RING_EVENTS - start)
+        len = RING_EVENTS - start;
+      if (!write_failed && write_all(&r->buf[start], len * sizeof(rec_event_t)) < 0) {
+        write_failed = 1;
+        warn("write failed, recording stopped");
+      }
+      head += len;
+      taken += len;
+      __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    }
+  }
+  return taken;
+}
+
+static void *writer_main(void *arg) {
+  struct timespec nap = {0, WRITER_NAP_NS};
+
+  (void)arg;
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+    if (drain() == 0)
+      nanosleep(&nap, NULL);
+  return NULL;
+}
+
+void rec_start(void) {
+  const char *path = getenv("MM_RECORD_FILE");
+
+  if (path == NULL)
+    path = "mmrecord.bin";
+  out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out_fd < 0 || write_all(REC_MAGIC, 8) < 0) {
+    warn("cannot open the output file, nothing will be recorded");
+    recording = 0;
+    return;
+  }
+  if (pthread_key_create(&ring_key, release_ring) != 0 ||
+      pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+    warn("cannot start the writer thread, nothing will be recorded");
+    recording = 0;
+    return;
+  }
+  writer_running = 1;
+}
+
+void rec_disable(void) { recording = 0; }
+
+void rec_finish(void) {
+  if (!writer_running)
+    return;
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(writer, NULL);
+  writer_running = 0;
+  drain();
+  close(out_fd);
+  if (dropped > 0)
+    warn("some events were dropped; the trace has gaps");
+}
+
+void rec_child(void) {
+  recording = 0;
+  writer_running = 0;
+}
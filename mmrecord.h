@@ -0,0 +1,44 @@
+/*
+ * mmrecord.h - allocation trace recorder for libmmrec.so
+ *
+ * The LD_PRELOAD front end (mmpreload.c) calls rec_event() for every
+ * request it completes, while it still holds the allocator lock, so
+ * the sequence numbers follow the order the allocator saw.
+ */
+#ifndef __MMRECORD_H_
+#define __MMRECORD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REC_MAGIC "MMREC001"   /* first 8 bytes of a recording */
+#define REC_ALLOC   0          /* ptr = new block */
+#define REC_FREE    1          /* ptr = freed block */
+#define REC_REALLOC 2          /* ptr = new block, old = previous block */
+#define REC_MEMALIGN 3         /* ptr = new block, old = alignment */
+
+/* One on-disk event; the file is REC_MAGIC followed by these */
+typedef struct {
+  uint64_t seq;       /* global request number, starting at 0 */
+  uint64_t ptr;
+  uint64_t old;
+  uint32_t size;      /* requested bytes (0 for REC_FREE) */
+  uint32_t op;        /* REC_ALLOC, REC_FREE or REC_REALLOC */
+} rec_event_t;
+
+/* Open $MM_RECORD_FILE (default mmrecord.bin) and start the writer */
+void rec_start(void);
+
+/* Log one completed request; call with the allocator lock held */
+void rec_event(uint32_t op, void *ptr, void *old, size_t size);
+
+/* Take no more events; call with the allocator lock held */
+void rec_disable(void);
+
+/* Wait for the writer to flush everything logged, then close the file */
+void rec_finish(void);
+
+/* In a forked child: there is no writer thread, so stop recording */
+void rec_child(void);
+
+#endif /* __MMRECORD_H_ */
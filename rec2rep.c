@@ -0,0 +1,295 @@
+/*
+ * rec2rep.c - Convert a libmmrec.so recording into a .rep trace
+ *
+ * The recorder logs raw block addresses in per-thread order. This
+ * puts the events back in the order the allocator served them (by
+ * sequence number) and gives every allocation a fresh block id, which
+ * a realloc carries over to the moved block. Blocks still live at the
+ * end of the recording are freed, as in every other trace.
+ *
+ * Requests the recording cannot account for are reported, not fatal:
+ * a free of an address never handed out (allocated before recording
+ * started, or lost in a gap) is skipped, and an address handed out
+ * twice without a free in between is treated as freed just before.
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmrecord.h"
+
+#define RANGES_LIMIT 100000      /* above this many ops, set ignore-ranges */
+
+static void app_error(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2), noreturn));
+
+static void app_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "rec2rep: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+	unsigned long long x = ((const rec_event_t *) a)->seq;
+	unsigned long long y = ((const rec_event_t *) b)->seq;
+	return (x > y) - (x < y);
+}
+
+/*******************************************************
+ * Live blocks: address -> block id, by linear probing
+ *******************************************************/
+
+typedef struct {
+	unsigned long long addr;   /* 0 marks an empty slot */
+	int id;
+} slot_t;
+
+static slot_t *table;
+static long table_cap, table_len;
+
+/* home - The slot addr hashes to */
+static long home(unsigned long long addr)
+{
+	return (long) ((addr * 0x9E3779B97F4A7C15ULL) >> 20) & (table_cap - 1);
+}
+
+/* slot_of - The slot holding addr, or the empty slot where it would go */
+static long slot_of(unsigned long long addr)
+{
+	long i = home(addr);
+
+	while (table[i].addr != 0 && table[i].addr != addr)
+		i = (i + 1) & (table_cap - 1);
+	return i;
+}
+
+static void table_grow(void)
+{
+	slot_t *old = table;
+	long old_cap = table_cap, i;
+
+	table_cap = table_cap ? 2 * table_cap : 4096;
+	if ((table = calloc(table_cap, sizeof(slot_t))) == NULL)
+		app_error("out of memory");
+	for (i = 0; i < old_cap; i++)
+		if (old[i].addr != 0)
+			table[slot_of(old[i].addr)] = old[i];
+	free(old);
+}
+
+/* table_find - Id of the live block at addr, or -1 */
+static int table_find(unsigned long long addr)
+{
+	long i;
+
+	if (table_cap == 0)
+		return -1;
+	i = slot_of(addr);
+	return (table[i].addr != 0) ? table[i].id : -1;
+}
+
+static void table_insert(unsigned long long addr, int id)
+{
+	long i;
+
+	if (2 * (table_len + 1) > table_cap)
+		table_grow();
+	i = slot_of(addr);
+	if (table[i].addr == 0)
+		table_len++;
+	table[i].addr = addr;
+	table[i].id = id;
+}
+
+/* table_remove - Delete addr, shifting later entries of its run back */
+static void table_remove(unsigned long long addr)
+{
+	long i = slot_of(addr), j = i, k;
+
+	if (table[i].addr == 0)
+		return;
+	table[i].addr = 0;
+	table_len--;
+	for (;;) {
+		j = (j + 1) & (table_cap - 1);
+		if (table[j].addr == 0)
+			return;
+		k = home(table[j].addr);
+		/* leave j alone if its home slot k lies cyclically in (i, j] */
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		table[i] = table[j];
+		table[j].addr = 0;
+		i = j;
+	}
+}
+
+/*******************************************************
+ * Output trace
+ *******************************************************/
+
+typedef struct {
+	char type;     /* 'a', 'm', 'r' or 'f' */
+	int id;
+	unsigned size;
+	unsigned long long align;   /* 'm' only */
+} op_t;
+
+static op_t *ops;
+static long nops, ops_cap;
+static int nids;
+
+static void emit(char type, int id, unsigned size, unsigned long long align)
+{
+	if (nops == ops_cap) {
+		ops_cap = ops_cap ? 2 * ops_cap : 4096;
+		if ((ops = realloc(ops, ops_cap * sizeof(op_t))) == NULL)
+			app_error("out of memory");
+	}
+	ops[nops].type = type;
+	ops[nops].id = id;
+	ops[nops].size = size ? size : 1;  /* the driver cannot check malloc(0) */
+	ops[nops].align = align;
+	nops++;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: rec2rep [-h] [-o file] <recording>\n"
+		"Options\n"
+		"\t-o <file>     Write the trace to <file> instead of stdout.\n");
+}
+
+int main(int argc, char **argv)
+{
+	rec_event_t *ev = NULL, *e;
+	long nev = 0, ev_cap = 0, i;
+	long gaps = 0, unknown = 0, reused = 0;
+	char magic[8], *outname = NULL;
+	FILE *in, *out = stdout;
+	int id, c;
+
+	while ((c = getopt(argc, argv, "o:h")) != -1) {
+		switch (c) {
+			case 'o':
+				outname = optarg;
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				usage();
+				exit(1);
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		exit(1);
+	}
+
+	if ((in = fopen(argv[optind], "rb")) == NULL)
+		app_error("could not open %s: %s", argv[optind], strerror(errno));
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, REC_MAGIC, 8) != 0)
+		app_error("%s is not an mmrecord file", argv[optind]);
+	for (;;) {
+		if (nev == ev_cap) {
+			ev_cap = ev_cap ? 2 * ev_cap : 65536;
+			if ((ev = realloc(ev, ev_cap * sizeof(rec_event_t))) == NULL)
+				app_error("out of memory");
+		}
+		if (fread(&ev[nev], sizeof(rec_event_t), 1, in) != 1)
+			break;
+		nev++;
+	}
+	fclose(in);
+
+	/* The writer interleaves the threads' rings; restore request order */
+	qsort(ev, nev, sizeof(rec_event_t), cmp_seq);
+
+	for (i = 0; i < nev; i++) {
+		e = &ev[i];
+		if (e->seq != (unsigned long long) (i ? ev[i - 1].seq + 1 : 0))
+			gaps++;
+		switch (e->op) {
+			case REC_ALLOC:
+			case REC_MEMALIGN:
+				if ((id = table_find(e->ptr)) >= 0) {
+					reused++;
+					emit('f', id, 0, 0);
+				}
+				table_insert(e->ptr, nids);
+				if (e->op == REC_MEMALIGN)
+					emit('m', nids++, e->size, e->old);
+				else
+					emit('a', nids++, e->size, 0);
+				break;
+			case REC_FREE:
+				if ((id = table_find(e->ptr)) < 0) {
+					unknown++;
+					break;
+				}
+				table_remove(e->ptr);
+				emit('f', id, 0, 0);
+				break;
+			case REC_REALLOC:
+				if ((id = table_find(e->old)) < 0) {
+					unknown++;
+					id = nids++;
+					emit('a', id, e->size, 0);
+				} else {
+					table_remove(e->old);
+					emit('r', id, e->size, 0);
+				}
+				if (table_find(e->ptr) >= 0) {
+					reused++;
+					emit('f', table_find(e->ptr), 0, 0);
+				}
+				table_insert(e->ptr, id);
+				break;
+			default:
+				app_error("bad event type %u at request %llu", e->op,
+						(unsigned long long) e->seq);
+		}
+	}
+
+	/* Free whatever is still live */
+	for (i = 0; i < table_cap; i++)
+		if (table[i].addr != 0)
+			emit('f', table[i].id, 0, 0);
+
+	if (outname && (out = fopen(outname, "w")) == NULL)
+		app_error("could not open %s: %s", outname, strerror(errno));
+	fprintf(out, "1\n%d\n%ld\n%d\n", nids, nops, nops > RANGES_LIMIT);
+	for (i = 0; i < nops; i++) {
+		if (ops[i].type == 'f')
+			fprintf(out, "f %d\n", ops[i].id);
+		else if (ops[i].type == 'm')
+			fprintf(out, "m %d %u %llu\n", ops[i].id, ops[i].size,
+					ops[i].align);
+		else
+			fprintf(out, "%c %d %u\n", ops[i].type, ops[i].id, ops[i].size);
+	}
+	if (out != stdout)
+		fclose(out);
+
+	fprintf(stderr, "rec2rep: %ld events, %d blocks, %ld trace ops\n",
+			nev, nids, nops);
+	if (gaps)
+		fprintf(stderr, "rec2rep: %ld gaps in the recording\n", gaps);
+	if (unknown)
+		fprintf(stderr, "rec2rep: %ld requests on unknown blocks\n", unknown);
+	if (reused)
+		fprintf(stderr, "rec2rep: %ld blocks handed out while live\n", reused);
+	return 0;
+}